@@ -10,12 +10,21 @@ LOCAL_SRC_FILES:= \
         thread_base.cpp \
         module_thread.cpp \
         board_control.cpp \
+        time_sync.cpp \
+        time_sync_server.cpp \
         d2d_tracker.cpp \
+        bitrate_controller.cpp \
+        link_history.cpp \
+        link_predictor.cpp \
+        rate_scheduler.cpp \
+        link_state.cpp \
+        telemetry_budget.cpp \
         wifi_control.cpp \
 
 ifeq ($(CAMERA_EXIST), yes)
 LOCAL_SRC_FILES += \
         camera_control.cpp \
+        camera_command_queue.cpp \
         camera_service/camera_service.cpp \
         camera_service/camera_callback.cpp \
 
@@ -35,6 +44,9 @@ endif
 
 ifeq ($(LAMP_SIGNAL_EXIST), yes)
 
+LOCAL_SRC_FILES += \
+        lamp_notifier.cpp \
+
 LOCAL_SHARED_LIBRARIES += \
         liblampsignal
 
@@ -60,3 +72,87 @@ LOCAL_MODULE:= system-control
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_EXECUTABLE)
+
+# host tool replaying recorded d2d traces through the bitrate controllers
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        tools/bitrate_sim.cpp \
+        config.cpp \
+        bitrate_controller.cpp \
+        link_history.cpp \
+        link_predictor.cpp \
+
+LOCAL_STATIC_LIBRARIES := \
+        liblog \
+
+LOCAL_C_INCLUDES += \
+        $(LOCAL_PATH) \
+        $(LOCAL_PATH)/../common/include/mavlink \
+        $(LOCAL_PATH)/../common/include/mavlink/ardupilotmega \
+
+LOCAL_MODULE:= bitrate-sim
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# host tool running the built-in module checks
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        tools/module_check.cpp \
+        config.cpp \
+        camera_command_queue.cpp \
+        link_state.cpp \
+        telemetry_budget.cpp \
+
+LOCAL_STATIC_LIBRARIES := \
+        liblog \
+
+LOCAL_C_INCLUDES += \
+        $(LOCAL_PATH) \
+        $(LOCAL_PATH)/../common/include/mavlink \
+        $(LOCAL_PATH)/../common/include/mavlink/ardupilotmega \
+
+LOCAL_MODULE:= module-check
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# d2d ingest benchmark, runs D2dTracker against a stub CameraService
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        tools/d2d_bench/d2d_bench.cpp \
+        config.cpp \
+        thread_base.cpp \
+        module_thread.cpp \
+        d2d_tracker.cpp \
+        bitrate_controller.cpp \
+        link_history.cpp \
+        link_predictor.cpp \
+        rate_scheduler.cpp \
+        link_state.cpp \
+        telemetry_budget.cpp \
+
+LOCAL_SHARED_LIBRARIES := \
+        libcutils \
+        liblog \
+        libutils \
+
+# the stub camera_service.h has to be found before the real one
+LOCAL_C_INCLUDES += \
+        $(LOCAL_PATH)/tools/d2d_bench \
+        $(LOCAL_PATH) \
+        $(LOCAL_PATH)/../common/include/mavlink \
+        $(LOCAL_PATH)/../common/include/mavlink/ardupilotmega \
+
+LOCAL_CFLAGS += -DCAMERA_EXIST
+
+LOCAL_MODULE:= d2d-bench
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
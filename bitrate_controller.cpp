@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utils/Log.h>
+
+#include "bitrate_controller.h"
+
+#undef LOG_TAG
+#define LOG_TAG "BitrateController"
+
+#define BITRATE_UNSET               INT_MIN
+#define AIMD_START_PCT              75      // of the granted bandwidth
+#define AIMD_DECREASE_PCT           75
+#define AIMD_INCREASE_PCT_PER_SEC   5       // of max_bitrate
+#define AIMD_MAX_STEP_MS            1000
+#define SMOOTHED_DOWN_SHIFT         1       // falls by 1/2 of the gap per update
+#define SMOOTHED_UP_SHIFT           3       // rises by 1/8 of the gap per update
+
+// a share of the gap, at least 1 so that small gaps in snr mode close too
+static int smoothed_step(int gap, int shift)
+{
+    int step = gap / (1 << shift);
+
+    if (step == 0 && gap != 0) {
+        step = gap > 0 ? 1 : -1;
+    }
+    return step;
+}
+
+BitrateController* BitrateController::create(const char* name, int adjust_mode,
+                                             const bitrate_params& params)
+{
+    if (name == nullptr || !strcmp(name, "legacy")) {
+        return new LegacyBitrateController(adjust_mode, params);
+    } else if (!strcmp(name, "aimd")) {
+        if (adjust_mode == BITRATE_ADJUST_BY_THROUGHPUT) {
+            return new AimdBitrateController(adjust_mode, params);
+        }
+        ALOGE("aimd needs throughput input, use smoothed for snr");
+        return new SmoothedBitrateController(adjust_mode, params);
+    } else if (!strcmp(name, "smoothed")) {
+        return new SmoothedBitrateController(adjust_mode, params);
+    }
+    ALOGE("unknown bitrate controller %s, use legacy", name);
+    return new LegacyBitrateController(adjust_mode, params);
+}
+
+BitrateController::BitrateController(int adjust_mode, const bitrate_params& params)
+    : _adjust_mode(adjust_mode)
+    , _params(params)
+    , _predictor(nullptr)
+    , _predict_cut(100)
+    , _last_bitrate(BITRATE_UNSET)
+    , _last_set_ms(0)
+    , _last_idr_ms(0)
+    , _idr_pending(false)
+    , _last_service_status(DISCONNECTED)
+{
+    if (_adjust_mode != BITRATE_ADJUST_BY_THROUGHPUT) {
+        // bounds are in kbps, they do not apply to snr values
+        _params.min_bitrate = INT_MIN;
+        _params.max_bitrate = INT_MAX;
+    }
+}
+
+bitrate_decision BitrateController::update(const d2d_info& info, uint64_t now_ms)
+{
+    bitrate_decision decision = { false, 0, false };
+    int target;
+    int delta;
+
+    if (info.service_status != CONNECTED) {
+        if (_last_bitrate != BITRATE_DUMMY_STATE) {
+            ALOGD("indicate codec to enter the dummy state");
+            decision.set_bitrate = true;
+            decision.bitrate = BITRATE_DUMMY_STATE;
+            _last_bitrate = BITRATE_DUMMY_STATE;
+            _last_set_ms = now_ms;
+        }
+        _idr_pending = false;
+        _last_service_status = info.service_status;
+        _reset();
+        return decision;
+    }
+
+    if (_last_service_status != CONNECTED) {
+        ALOGD("reconnected, request idr");
+        _idr_pending = true;
+    }
+    _last_service_status = CONNECTED;
+    // a flapping link would otherwise trigger a key frame per reconnect
+    if (_idr_pending && (_last_idr_ms == 0 ||
+                         now_ms - _last_idr_ms >= _params.idr_min_interval_ms)) {
+        decision.request_idr = true;
+        _idr_pending = false;
+        _last_idr_ms = now_ms;
+    }
+
+    target = _clamp(_apply_prediction(_compute_target(info, now_ms)));
+    if (_last_bitrate != BITRATE_UNSET && _last_bitrate != BITRATE_DUMMY_STATE) {
+        if (target == _last_bitrate) {
+            return decision;
+        }
+        delta = abs(target - _last_bitrate);
+        if ((int64_t)delta * 100 < (int64_t)_params.hysteresis * abs(_last_bitrate)) {
+            return decision;
+        }
+        // decreases go out at once, increases are rate limited
+        if (target > _last_bitrate && now_ms - _last_set_ms < _params.min_interval_ms) {
+            return decision;
+        }
+    }
+    ALOGV("%s bitrate %d -> %d", get_name(), _last_bitrate, target);
+    decision.set_bitrate = true;
+    decision.bitrate = target;
+    _last_bitrate = target;
+    _last_set_ms = now_ms;
+    return decision;
+}
+
+void BitrateController::set_predictor(LinkPredictor* predictor, int cut)
+{
+    _predictor = predictor;
+    _predict_cut = cut;
+}
+
+// Lowers the target ahead of a predicted drop. In snr mode the encoder maps
+// snr to a bitrate itself, so it gets the projected snr instead.
+int BitrateController::_apply_prediction(int target)
+{
+    int projected;
+
+    if (_predictor == nullptr || !_predictor->is_degrading()) {
+        return target;
+    }
+    if (_adjust_mode == BITRATE_ADJUST_BY_THROUGHPUT) {
+        return (int64_t)target * _predict_cut / 100;
+    }
+    projected = _predictor->get_projected_snr();
+    return projected < target ? projected : target;
+}
+
+int BitrateController::_get_input(const d2d_info& info)
+{
+    return (_adjust_mode == BITRATE_ADJUST_BY_THROUGHPUT) ? info.ul_bandwidth : info.snr;
+}
+
+int BitrateController::_clamp(int bitrate)
+{
+    if (bitrate < _params.min_bitrate) {
+        return _params.min_bitrate;
+    }
+    if (bitrate > _params.max_bitrate) {
+        return _params.max_bitrate;
+    }
+    return bitrate;
+}
+
+LegacyBitrateController::LegacyBitrateController(int adjust_mode, const bitrate_params& params)
+    : BitrateController(adjust_mode, params)
+{
+    // every change is forwarded unfiltered
+    _params.min_bitrate = INT_MIN;
+    _params.max_bitrate = INT_MAX;
+    _params.hysteresis = 0;
+    _params.min_interval_ms = 0;
+}
+
+int LegacyBitrateController::_compute_target(const d2d_info& info, uint64_t now_ms)
+{
+    (void) now_ms;
+    return _get_input(info);
+}
+
+AimdBitrateController::AimdBitrateController(int adjust_mode, const bitrate_params& params)
+    : BitrateController(adjust_mode, params)
+{
+    _reset();
+}
+
+void AimdBitrateController::_reset()
+{
+    _started = false;
+    _target = 0;
+    _last_update_ms = 0;
+    _last_decrease_ms = 0;
+}
+
+int AimdBitrateController::_compute_target(const d2d_info& info, uint64_t now_ms)
+{
+    int capacity = _clamp(info.ul_bandwidth);
+    uint64_t elapsed;
+
+    if (!_started) {
+        _started = true;
+        _target = (int64_t)capacity * AIMD_START_PCT / 100;
+        _last_update_ms = now_ms;
+        return _target;
+    }
+    elapsed = now_ms - _last_update_ms;
+    if (elapsed > AIMD_MAX_STEP_MS) {
+        elapsed = AIMD_MAX_STEP_MS;
+    }
+    _last_update_ms = now_ms;
+
+    if (capacity < _target) {
+        _target = (int64_t)_target * AIMD_DECREASE_PCT / 100;
+        if (_target > capacity) {
+            _target = capacity;
+        }
+        _last_decrease_ms = now_ms;
+    } else if (now_ms - _last_decrease_ms >= _params.ramp_holdoff_ms) {
+        _target += (int64_t)_params.max_bitrate * AIMD_INCREASE_PCT_PER_SEC * elapsed / 100 / 1000;
+        if (_target > capacity) {
+            _target = capacity;
+        }
+    }
+    return _target;
+}
+
+SmoothedBitrateController::SmoothedBitrateController(int adjust_mode, const bitrate_params& params)
+    : BitrateController(adjust_mode, params)
+{
+    _reset();
+}
+
+void SmoothedBitrateController::_reset()
+{
+    _started = false;
+    _target = 0;
+    _last_decrease_ms = 0;
+}
+
+int SmoothedBitrateController::_compute_target(const d2d_info& info, uint64_t now_ms)
+{
+    int input = _get_input(info);
+
+    if (!_started) {
+        _started = true;
+        _target = input;
+    } else if (input < _target) {
+        _target += smoothed_step(input - _target, SMOOTHED_DOWN_SHIFT);
+        _last_decrease_ms = now_ms;
+    } else if (now_ms - _last_decrease_ms >= _params.ramp_holdoff_ms) {
+        _target += smoothed_step(input - _target, SMOOTHED_UP_SHIFT);
+    }
+    return _target;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdint.h>
+#include "d2d_info.h"
+#include "link_predictor.h"
+
+#define BITRATE_DUMMY_STATE (-99)   // tells the codec to enter the dummy state
+
+// input fed to the encoder, selected by persist.camera.bitrate.adjust.mode
+enum {
+    BITRATE_ADJUST_BY_THROUGHPUT = 0,
+    BITRATE_ADJUST_BY_SNR,
+};
+
+struct bitrate_params {
+    int min_bitrate;                // lower bound of the target, in input units
+    int max_bitrate;                // upper bound of the target, in input units
+    int hysteresis;                 // percent change needed before a new target is sent
+    uint32_t min_interval_ms;       // between two increases
+    uint32_t idr_min_interval_ms;   // between two idr requests
+    uint32_t ramp_holdoff_ms;       // no increase for this long after a decrease
+};
+
+struct bitrate_decision {
+    bool set_bitrate;
+    int bitrate;
+    bool request_idr;
+};
+
+/*
+ * Turns d2d link updates into encoder bitrate and idr requests. The base
+ * class owns the connect/disconnect handling, the hysteresis and the rate
+ * limits; subclasses only compute the wanted target from a link update.
+ * Time is passed in, so the controllers can be driven faster than real
+ * time.
+ */
+class BitrateController {
+public:
+    static BitrateController* create(const char* name, int adjust_mode,
+                                     const bitrate_params& params);
+    virtual ~BitrateController() { }
+    bitrate_decision update(const d2d_info& info, uint64_t now_ms);
+    void set_predictor(LinkPredictor* predictor, int cut);
+    virtual const char* get_name() = 0;
+
+protected:
+    BitrateController(int adjust_mode, const bitrate_params& params);
+    int _get_input(const d2d_info& info);
+    int _clamp(int bitrate);
+    virtual int _compute_target(const d2d_info& info, uint64_t now_ms) = 0;
+    virtual void _reset() { }
+
+    int _apply_prediction(int target);
+
+    int _adjust_mode;
+    bitrate_params _params;
+    LinkPredictor* _predictor;
+    int _predict_cut;               // percent of the target kept when a drop is predicted
+    int _last_bitrate;              // last value sent to the encoder
+    uint64_t _last_set_ms;
+    uint64_t _last_idr_ms;
+    bool _idr_pending;
+    int _last_service_status;
+};
+
+// forwards the raw ul_bandwidth or snr, as the tracker always did
+class LegacyBitrateController : public BitrateController {
+public:
+    LegacyBitrateController(int adjust_mode, const bitrate_params& params);
+    virtual const char* get_name() override { return "legacy"; }
+
+protected:
+    virtual int _compute_target(const d2d_info& info, uint64_t now_ms) override;
+};
+
+// additive increase while the granted bandwidth allows it, multiplicative
+// decrease when it falls below the target
+class AimdBitrateController : public BitrateController {
+public:
+    AimdBitrateController(int adjust_mode, const bitrate_params& params);
+    virtual const char* get_name() override { return "aimd"; }
+
+protected:
+    virtual int _compute_target(const d2d_info& info, uint64_t now_ms) override;
+    virtual void _reset() override;
+
+private:
+    bool _started;
+    int _target;
+    uint64_t _last_update_ms;
+    uint64_t _last_decrease_ms;
+};
+
+// follows the input through an ewma that falls fast and rises slowly
+class SmoothedBitrateController : public BitrateController {
+public:
+    SmoothedBitrateController(int adjust_mode, const bitrate_params& params);
+    virtual const char* get_name() override { return "smoothed"; }
+
+protected:
+    virtual int _compute_target(const d2d_info& info, uint64_t now_ms) override;
+    virtual void _reset() override;
+
+private:
+    bool _started;
+    int _target;
+    uint64_t _last_decrease_ms;
+};
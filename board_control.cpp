@@ -21,6 +21,7 @@
 #include <utils/Log.h>
 
 #include "config.h"
+#include "telemetry_budget.h"
 #include "board_control.h"
 
 #ifdef LAMP_SIGNAL_EXIST
@@ -31,26 +32,51 @@
 #undef LOG_TAG
 #define LOG_TAG "BoardControl"
 #define POLLING_RATE_TIMEOUT_MS (500)
-#define TIME_SYNC_RATE 1
 #define BOARD_CONTROL_SOCK_NAME "boardcontrol"
+#define BOARD_TELEMETRY_VERSION 1
+#define BOARD_TELEMETRY_DATA_TYPE 0x42
+#define TIME_SYNC_STATS_INTERVAL_MS 30000
+#define TELEMETRY_MAX_INTERVAL_MS 10000
+#define TIME_SYNC_MIN_INTERVAL_MS 500
+#define TIME_SYNC_MAX_INTERVAL_MS 16000
+
+static const board_sensor g_board_sensors[SENSOR_MAX] = {
+    // name                 path                                                    divisor default
+    { "cpu_temperature",    "/sys/class/thermal/thermal_zone4/temp",                  1,      -1 },
+    { "board_temperature",  "/sys/bus/iio/devices/iio:device1/in_voltage2_adc2_input", 10,    0 },
+    { "battery_level",      "/sys/class/power_supply/battery/capacity",               1,      -1 },
+    { "charging_state",     "/sys/class/power_supply/ac/online",                      1,      0 },
+};
 
 BoardControl::BoardControl()
     : ModuleThread{"BoardControl"}
     , _timer_fd(-1)
     , _sock_fd(-1)
-    , _last_board_temperature(0)
-    , _time_sync_counter(0)
-    , _time_sync_done(false)
-    , _cpu_temp(-1)
-    , _battery_level(-1)
-    , _is_charging(0)
+    , _telemetry_stream(-1)
+    , _telemetry_budget(-1)
+    , _time_sync_budget(-1)
+    , _last_stats_dump_ms(0)
+    , _reply_count(0)
 {
+    bzero((void*)&_telemetry, sizeof(_telemetry));
+    _telemetry.version = BOARD_TELEMETRY_VERSION;
+    for (int i = 0; i < SENSOR_MAX; i++) {
+        _telemetry.value[i] = g_board_sensors[i].default_value;
+    }
     _system_id = Config::get_instance()->get_board_system_id();
     _comp_id = Config::get_instance()->get_board_comp_id();
+    _time_sync_server.set_client_rate(Config::get_instance()->get_time_sync_client_rate());
+    _time_sync_server_id = Config::get_instance()->get_time_sync_server_id();
+    for (int i = 0; i < TX_BATCH_SIZE; i++) {
+        _reply_bufs[i] = _reply_packets[i];
+    }
 
 #ifdef LAMP_SIGNAL_EXIST
     _last_temp_state = NOT_WORKING;
     _last_battery_state = NOT_WORKING;
+    _last_charging_state = NOT_WORKING;
+    _last_lamp_notify_ms = 0;
+    _lamp_notifier = nullptr;
     sp<IBinder> binder = defaultServiceManager()->getService(String16(LampSignalService::getServiceName()));
     if (binder == nullptr) {
         ALOGE("failed to get service: %s", LampSignalService::getServiceName());
@@ -58,6 +84,14 @@ BoardControl::BoardControl()
         _listener = interface_cast<ISystemStatusListener>(binder);
         if (_listener == nullptr) {
             ALOGE("failed to cast LampSignalService interface");
+        } else {
+            _lamp_notifier = new LampNotifier(_listener);
+            if (!_lamp_notifier->start_thread()) {
+                ALOGE("failed to start lamp notifier");
+                delete _lamp_notifier;
+                _lamp_notifier = nullptr;
+                _listener = nullptr;
+            }
         }
     }
 #endif
@@ -76,10 +110,25 @@ bool BoardControl::start()
         ALOGE("Unable to create sockfd");
         goto fail;
     }
+    // stamp time sync messages as they are read rather than after parsing;
+    // on this AF_UNIX socket that is recvmsg time, not wire arrival
+    _enable_rx_timestamp(_sock_fd);
     if (!_add_read_fd(_sock_fd, TYPE_DATAGRAM_SOCK_FD)) {
         ALOGE("Unable to add _sock_fd to epoll");
         goto fail;
     }
+    if (Config::get_instance()->get_in_air()) {
+        _telemetry_stream = _add_stream("board_telemetry",
+                                        Config::get_instance()->get_board_telemetry_interval());
+        _telemetry_budget = TelemetryBudget::get_instance()->add_producer(
+            "board_telemetry", TELEMETRY_PRIORITY_LOW,
+            MAVLINK_NUM_NON_PAYLOAD_BYTES + MAVLINK_MSG_ID_DATA32_LEN,
+            Config::get_instance()->get_board_telemetry_interval(), TELEMETRY_MAX_INTERVAL_MS);
+    }
+    _time_sync_budget = TelemetryBudget::get_instance()->add_producer(
+        "time_sync", TELEMETRY_PRIORITY_MEDIUM,
+        MAVLINK_NUM_NON_PAYLOAD_BYTES + MAVLINK_MSG_ID_TIMESYNC_LEN,
+        TIME_SYNC_MIN_INTERVAL_MS, TIME_SYNC_MAX_INTERVAL_MS);
     return ModuleThread::start();
 
 fail:
@@ -96,28 +145,25 @@ fail:
 
 bool BoardControl::_handle_timeout(int fd)
 {
-    int ret;
-    int temperature;
     if (_timer_fd == fd) {
         if (Config::get_instance()->get_in_air()) {
-            // sendout board temperature, only in air
-            ret = _get_board_temperature(&temperature);
-            if (ret == 0 && temperature != _last_board_temperature) {
-                _last_board_temperature = temperature;
-                 ALOGD("temperature changed to %d", temperature);
-                _send_board_temperature_message(_last_board_temperature/10);
+            // sensor telemetry, only in air
+            _sample_sensors();
+            if (_telemetry.changed_mask != 0) {
+                // changes keep accumulating in changed_mask until it goes out
+                _update_stream(_telemetry_stream);
             }
             // sync time request with gcs, only in air
             _send_time_sync_request();
+        } else {
+            // probe the aircraft for their offset and rtt statistics
+            _send_time_sync_probe();
 #ifdef LAMP_SIGNAL_EXIST
-        } else if (_listener != nullptr) {
-            // update cpu temp
-            _get_cpu_temperature(&_cpu_temp);
-            // update battery state
-            _get_battery_stat(&_battery_level);
-            // update charging state
-            _get_charging_stat(&_is_charging);
-            _signal_lamp_service();
+            if (_listener != nullptr) {
+                // the lamp shows the ground board's own sensors
+                _sample_sensors();
+                _signal_lamp_service();
+            }
 #endif
         }
         return true;
@@ -140,179 +186,170 @@ bool BoardControl::_process_data(int fd, uint8_t* buf, int len,
         return false;
     }
     if (msg.msgid == MAVLINK_MSG_ID_TIMESYNC) {
-        timeval tv;
         mavlink_timesync_t timesync;
         mavlink_msg_timesync_decode(&msg, &timesync);
 
-        if (!Config::get_instance()->get_in_air()) {
-            // acting as time server, respond the request
-            if ((timesync.tc1 > 0) && (timesync.ts1 == 0)) {
-                if (gettimeofday(&tv, NULL) == 0) {
-                    ALOGD("response time sync from %ld to %ld", timesync.tc1, tv.tv_sec);
-                    _send_time_sync_message(timesync.tc1, tv.tv_sec);
-                } else {
-                    ALOGE("gettimeofday failed! %d", errno);
-                }
+        if ((timesync.tc1 == 0) && (timesync.ts1 > 0)) {
+            // a request, the ground side answers within the client's rate
+            // limit, the air side answers probes of the ground server
+            if (Config::get_instance()->get_in_air() ||
+                _time_sync_server.accept_request(msg.sysid, _get_monotonic_ms())) {
+                ALOGV("response time sync from %lld to %lld",
+                      (long long)timesync.ts1, (long long)_get_rx_time_ns());
+                _queue_time_sync_reply(_get_rx_time_ns(), timesync.ts1);
             }
-        } else {
-            // acting as time client, set time according to the response
-            if(timesync.ts1 > 0) {
-                _time_sync_done = true;
-            }
-            if (gettimeofday(&tv, NULL) == 0) {
-                int64_t delta = timesync.ts1 - tv.tv_sec;
-                if(delta > 60 || delta < -60) {
-                    ALOGD("try to set time from %ld to %ld", tv.tv_sec, timesync.ts1);
-                    tv.tv_sec = timesync.ts1;
-                    tv.tv_usec = 0;
-                    if(settimeofday(&tv, NULL) != 0) {
-                        ALOGE("failed to settimeofday! %d", errno);
-                    }
+        } else if (timesync.tc1 > 0) {
+            if (Config::get_instance()->get_in_air()) {
+                // acting as time client, feed the response to the estimator.
+                // Other aircraft answer requests too, only our server counts.
+                if (_time_sync_server_id != 0 && msg.sysid != _time_sync_server_id) {
+                    ALOGV("ignore time sync response from %d", msg.sysid);
+                } else if (_time_sync.handle_response(timesync.tc1, timesync.ts1,
+                                                      _get_rx_time_ns()) &&
+                           _time_sync_server_id == 0) {
+                    ALOGD("time sync server is %d", msg.sysid);
+                    _time_sync_server_id = msg.sysid;
                 }
             } else {
-                ALOGE("gettimeofday failed! %d", errno);
+                _time_sync_server.handle_probe_response(msg.sysid, timesync.tc1, timesync.ts1,
+                                                        _get_rx_time_ns(), _get_monotonic_ms());
             }
         }
     }
     return true;
 }
 
+void BoardControl::_process_data_done(int fd)
+{
+    if (fd != _sock_fd || _reply_count == 0) {
+        return;
+    }
+    _send_messages(_sock_fd, _reply_bufs, _reply_lens, _reply_count,
+                   Config::get_instance()->get_board_endpoint_name(),
+                   TYPE_DOMAIN_SOCK_ABSTRACT);
+    _reply_count = 0;
+}
+
 void BoardControl::_send_time_sync_request()
 {
-    uint32_t sync_rate = TIME_SYNC_RATE;
-    if (_time_sync_done) {
-        sync_rate *= 60;
+    uint64_t now = _get_monotonic_ms();
+
+    if (_time_sync.request_due(now) && TelemetryBudget::get_instance()->allow(_time_sync_budget, now)) {
+        _send_time_sync_message(0, _time_sync.make_request());
     }
-    if (++_time_sync_counter >= sync_rate) {
-        _time_sync_counter = 0;
-        timeval tv;
-        if (gettimeofday(&tv, NULL) == 0) {
-            ALOGV("gettimeofday %ld", tv.tv_sec);
-            _send_time_sync_message(tv.tv_sec, 0);
-        } else {
-            ALOGD("gettimeofday failed!");
-        }
+}
+
+void BoardControl::_send_time_sync_probe()
+{
+    uint64_t now = _get_monotonic_ms();
+
+    if (_time_sync_server.probe_due(now) &&
+        TelemetryBudget::get_instance()->allow(_time_sync_budget, now)) {
+        _send_time_sync_message(0, _time_sync_server.make_probe());
+    }
+    if (now - _last_stats_dump_ms >= TIME_SYNC_STATS_INTERVAL_MS) {
+        _last_stats_dump_ms = now;
+        _time_sync_server.dump_stats();
     }
 }
 
-bool BoardControl::_send_time_sync_message(int64_t tc1, int64_t ts1)
+void BoardControl::_queue_time_sync_reply(int64_t tc1, int64_t ts1)
 {
-    uint8_t packet[MAVLINK_MAX_PACKET_LEN];
-    int len;
     mavlink_message_t msg;
 
+    if (_reply_count == TX_BATCH_SIZE) {
+        _process_data_done(_sock_fd);
+    }
     mavlink_msg_timesync_pack(_system_id, _comp_id, &msg, tc1, ts1);
-    len = mavlink_msg_to_send_buffer(packet, &msg);
-    return _send_message(_sock_fd, packet, len,
-                         Config::get_instance()->get_board_endpoint_name(),
-                         TYPE_DOMAIN_SOCK_ABSTRACT);
+    _reply_lens[_reply_count] = mavlink_msg_to_send_buffer(_reply_packets[_reply_count], &msg);
+    _reply_count++;
 }
 
-bool BoardControl::_send_board_temperature_message(int16_t temp)
+bool BoardControl::_send_time_sync_message(int64_t tc1, int64_t ts1)
 {
     uint8_t packet[MAVLINK_MAX_PACKET_LEN];
     int len;
     mavlink_message_t msg;
 
-    mavlink_msg_scaled_pressure_pack(_system_id, _comp_id, &msg,
-                                         0, 0, 0, temp);
-
+    mavlink_msg_timesync_pack(_system_id, _comp_id, &msg, tc1, ts1);
     len = mavlink_msg_to_send_buffer(packet, &msg);
     return _send_message(_sock_fd, packet, len,
                          Config::get_instance()->get_board_endpoint_name(),
                          TYPE_DOMAIN_SOCK_ABSTRACT);
 }
 
-int BoardControl::_get_board_temperature(int* temp)
+void BoardControl::_send_stream(int stream)
 {
-    FILE *fp;
-    char line[256];
-
-    fp = popen("cat /sys/bus/iio/devices/iio:device1/in_voltage2_adc2_input", "r");
-    if (fp == NULL) {
-        ALOGE("Failed to read in_voltage2_adc2_input!");
-        return -1;
-    }
-
-    /* Read the output a line at a time - output it. */
-    if (fgets(line, sizeof(line)-1, fp) != NULL) {
-        ALOGV("in_voltage2_adc2_input is %s", line);
-        *temp = atoi(line);
-    } else {
-        ALOGE("reading null from in_voltage2_adc2_input!");
-        return -1;
+    if (stream == _telemetry_stream) {
+        // a skipped tick keeps changed_mask, the next poll marks it again
+        if (!TelemetryBudget::get_instance()->allow(_telemetry_budget, _get_monotonic_ms())) {
+            return;
+        }
+        _send_telemetry_message();
+        _telemetry.changed_mask = 0;
     }
-    pclose(fp);
-    return 0;
 }
 
-int BoardControl::_get_cpu_temperature(int* temp)
+bool BoardControl::_send_telemetry_message()
 {
-    FILE *fp;
-    char line[256];
+    uint8_t packet[MAVLINK_MAX_PACKET_LEN];
+    int len;
+    mavlink_message_t msg;
 
-    fp = popen("cat /sys/class/thermal/thermal_zone4/temp", "r");
-    if (fp == NULL) {
-        ALOGE("Failed to read thermal_zone4 temp!");
-        return -1;
-    }
+    mavlink_msg_data32_pack(_system_id, _comp_id, &msg,
+                            BOARD_TELEMETRY_DATA_TYPE, sizeof(_telemetry),
+                            (const uint8_t*)&_telemetry);
 
-    /* Read the output a line at a time - output it. */
-    if (fgets(line, sizeof(line)-1, fp) != NULL) {
-        ALOGV("cpu temp is %s", line);
-        *temp = atoi(line);
-    } else {
-        ALOGE("reading null from thermal_zone4 temp!");
-        return -1;
-    }
-    pclose(fp);
-    return 0;
+    len = mavlink_msg_to_send_buffer(packet, &msg);
+    return _send_message(_sock_fd, packet, len,
+                         Config::get_instance()->get_board_endpoint_name(),
+                         TYPE_DOMAIN_SOCK_ABSTRACT);
 }
 
-int BoardControl::_get_battery_stat(int* battery_level)
+void BoardControl::_sample_sensors()
 {
-    FILE *fp;
-    char line[256];
-
-    fp = popen("cat /sys/class/power_supply/battery/capacity", "r");
-    if (fp == NULL) {
-        ALOGE("Failed to read battery capacity!");
-        return -1;
-    }
+    int i;
+    int value;
+    uint8_t bit;
 
-    /* Read the output a line at a time - output it. */
-    if (fgets(line, sizeof(line)-1, fp) != NULL) {
-        ALOGV("battery level is %s", line);
-        *battery_level = atoi(line);
-    } else {
-        ALOGE("reading null from battery capacity!");
-        return -1;
+    for (i = 0; i < SENSOR_MAX; i++) {
+        bit = 1 << i;
+        if (_read_sensor(&g_board_sensors[i], &value) != 0) {
+            if (_telemetry.valid_mask & bit) {
+                ALOGE("failed to read %s from %s", g_board_sensors[i].name,
+                      g_board_sensors[i].path);
+                _telemetry.valid_mask &= ~bit;
+                _telemetry.value[i] = g_board_sensors[i].default_value;
+                _telemetry.changed_mask |= bit;
+            }
+            continue;
+        }
+        value /= g_board_sensors[i].divisor;
+        if (!(_telemetry.valid_mask & bit) || _telemetry.value[i] != value) {
+            ALOGV("%s changed to %d", g_board_sensors[i].name, value);
+            _telemetry.valid_mask |= bit;
+            _telemetry.value[i] = value;
+            _telemetry.changed_mask |= bit;
+        }
     }
-    pclose(fp);
-    return 0;
 }
 
-int BoardControl::_get_charging_stat(int* is_charging)
+int BoardControl::_read_sensor(const board_sensor* sensor, int* value)
 {
     FILE *fp;
-    char line[256];
+    char line[32];
+    int ret = -1;
 
-    fp = popen("cat /sys/class/power_supply/ac/online", "r");
+    fp = fopen(sensor->path, "r");
     if (fp == NULL) {
-        ALOGE("Failed to read ac online!");
         return -1;
     }
-
-    /* Read the output a line at a time - output it. */
-    if (fgets(line, sizeof(line)-1, fp) != NULL) {
-        ALOGV("ac online is %s", line);
-        *is_charging = atoi(line);
-    } else {
-        ALOGE("reading null from ac online!");
-        return -1;
+    if (fgets(line, sizeof(line), fp) != NULL) {
+        *value = atoi(line);
+        ret = 0;
     }
-    pclose(fp);
-    return 0;
+    fclose(fp);
+    return ret;
 }
 
 void BoardControl::_signal_lamp_service()
@@ -322,42 +359,56 @@ void BoardControl::_signal_lamp_service()
        ALOGE("_listener invalid");
        return;
     }
-    SystemStatus state;
-    if (_cpu_temp > Config::get_instance()->get_cpu_temperature_high_value()) {
-        state = TEMP_ABNORMAL;
+    SystemStatus temp_state;
+    SystemStatus battery_state;
+    SystemStatus charging_state;
+    int cpu_temp = _telemetry.value[SENSOR_CPU_TEMPERATURE];
+    int battery_level = _telemetry.value[SENSOR_BATTERY_LEVEL];
+    int is_charging = _telemetry.value[SENSOR_CHARGING_STATE];
+    int temp_high = Config::get_instance()->get_cpu_temperature_high_value();
+    int battery_low = Config::get_instance()->get_battery_level_low_value();
+    int keepalive = Config::get_instance()->get_lamp_keepalive_interval();
+    uint64_t now = _get_monotonic_ms();
+
+    // leaving an abnormal state needs to pass the threshold by the hysteresis
+    if (_last_temp_state == TEMP_ABNORMAL) {
+        temp_high -= Config::get_instance()->get_cpu_temperature_hysteresis();
+    }
+    if (cpu_temp > temp_high) {
+        temp_state = TEMP_ABNORMAL;
     } else {
-        state = TEMP_NORMAL;
+        temp_state = TEMP_NORMAL;
     }
-    if (state != _last_temp_state) {
-        _last_temp_state = state;
-        ALOGD("cpu temp state changed to %d", state);
+    if (_last_battery_state == POWER_ABNORMAL) {
+        battery_low += Config::get_instance()->get_battery_level_hysteresis();
     }
-    _listener->onStatusChanged(_last_temp_state, false);
-    if (_battery_level < Config::get_instance()->get_battery_level_low_value()) {
-        state = POWER_ABNORMAL;
+    if (battery_level < battery_low) {
+        battery_state = POWER_ABNORMAL;
     } else {
-        state = POWER_NORMAL;
-    }
-    if (state != _last_battery_state) {
-        _last_battery_state = state;
-        ALOGD("battery state changed to %d", state);
+        battery_state = POWER_NORMAL;
     }
-    _listener->onStatusChanged(_last_battery_state, false);
-    state = NOT_WORKING;
-    if (_is_charging) {
-        if (_battery_level < 100) {
-            state = IN_CHARGING;
+    charging_state = NOT_WORKING;
+    if (is_charging) {
+        if (battery_level < 100) {
+            charging_state = IN_CHARGING;
         } else {
-            state = FINISH_CHARGE;
+            charging_state = FINISH_CHARGE;
         }
     }
-    if (state != _last_charging_state) {
-        _last_charging_state = state;
-        ALOGD("charging state changed to %d", state);
-    }
-    // only send state when charging is on
-    if (_last_charging_state > NOT_WORKING) {
-        _listener->onStatusChanged(_last_charging_state, false);
+
+    if (temp_state != _last_temp_state) {
+        ALOGD("cpu temp state changed to %d", temp_state);
+    } else if (battery_state != _last_battery_state) {
+        ALOGD("battery state changed to %d", battery_state);
+    } else if (charging_state != _last_charging_state) {
+        ALOGD("charging state changed to %d", charging_state);
+    } else if (keepalive <= 0 || now - _last_lamp_notify_ms < (uint64_t)keepalive) {
+        return;
     }
+    _last_temp_state = temp_state;
+    _last_battery_state = battery_state;
+    _last_charging_state = charging_state;
+    _last_lamp_notify_ms = now;
+    _lamp_notifier->post(temp_state, battery_state, charging_state);
 #endif
 }
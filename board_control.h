@@ -16,13 +16,41 @@
 
 #pragma once
 #include "module_thread.h"
+#include "time_sync.h"
+#include "time_sync_server.h"
 
 #ifdef LAMP_SIGNAL_EXIST
 #include <ISystemStatusListener.h>
+#include "lamp_notifier.h"
 
 using namespace android;
 #endif
 
+// sensors sampled into the board telemetry record, indexes into board_telemetry.value
+enum {
+    SENSOR_CPU_TEMPERATURE = 0,
+    SENSOR_BOARD_TEMPERATURE,
+    SENSOR_BATTERY_LEVEL,
+    SENSOR_CHARGING_STATE,
+    SENSOR_MAX
+};
+
+struct board_sensor {
+    const char* name;
+    const char* path;       // sysfs node holding one integer
+    int divisor;            // raw value is divided by it before reporting
+    int default_value;      // value used until the first successful read
+};
+
+// fixed layout record, sent as payload of one DATA32 message
+struct __attribute__((packed)) board_telemetry {
+    uint8_t version;
+    uint8_t valid_mask;     // bit n set: value[n] holds a sampled value
+    uint8_t changed_mask;   // bit n set: value[n] changed since last report
+    uint8_t reserved;
+    int32_t value[SENSOR_MAX];
+};
+
 class BoardControl : public ModuleThread {
 public:
     BoardControl();
@@ -32,30 +60,40 @@ protected:
     virtual bool _handle_timeout(int fd) override;
     virtual bool _process_data(int fd, uint8_t* buf, int len,
                                struct sockaddr* src_addr, int addrlen) override;
+    virtual void _process_data_done(int fd) override;
+    virtual void _send_stream(int stream) override;
     void _send_time_sync_request();
+    void _send_time_sync_probe();
+    void _queue_time_sync_reply(int64_t tc1, int64_t ts1);
     bool _send_time_sync_message(int64_t tc1, int64_t ts1);
-    bool _send_board_temperature_message(int16_t temp);
-    int _get_cpu_temperature(int* temp);
-    int _get_board_temperature(int* temp);
-    int _get_battery_stat(int* battery_level);
-    int _get_charging_stat(int* is_charging);
+    void _sample_sensors();
+    int _read_sensor(const board_sensor* sensor, int* value);
+    bool _send_telemetry_message();
     void _signal_lamp_service();
 
 private:
     int _timer_fd;
     int _sock_fd;
-    int _last_board_temperature;
+    int _telemetry_stream;
+    int _telemetry_budget;
+    int _time_sync_budget;
     uint8_t _system_id;
     uint8_t _comp_id;
-    uint32_t _time_sync_counter;
-    bool _time_sync_done;
-    int _cpu_temp;
-    int _battery_level;
-    int _is_charging;
+    TimeSync _time_sync;
+    uint8_t _time_sync_server_id;       // 0 until the first server answered
+    TimeSyncServer _time_sync_server;
+    uint64_t _last_stats_dump_ms;
+    uint8_t _reply_packets[TX_BATCH_SIZE][MAVLINK_MAX_PACKET_LEN];
+    uint8_t* _reply_bufs[TX_BATCH_SIZE];
+    size_t _reply_lens[TX_BATCH_SIZE];
+    int _reply_count;
+    board_telemetry _telemetry;
 #ifdef LAMP_SIGNAL_EXIST
     SystemStatus _last_temp_state;
     SystemStatus _last_battery_state;
     SystemStatus _last_charging_state;
+    uint64_t _last_lamp_notify_ms;
     sp<ISystemStatusListener> _listener;
+    LampNotifier* _lamp_notifier;
 #endif
 };
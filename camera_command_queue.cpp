@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <utils/Log.h>
+
+#include "camera_command_queue.h"
+
+#undef LOG_TAG
+#define LOG_TAG "CameraCommandQueue"
+
+CameraCommandQueue::CameraCommandQueue()
+    : _busy(false)
+    , _kicked(false)
+    , _cancelled(false)
+    , _closed(false)
+    , _results_next(0)
+{
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&_lock, NULL);
+    // pop waits on the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    bzero((void*)&_running, sizeof(_running));
+    bzero((void*)_results, sizeof(_results));
+}
+
+CameraCommandQueue::~CameraCommandQueue()
+{
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+}
+
+int CameraCommandQueue::push(const mavlink_message_t& msg, uint64_t now_ms, uint8_t* result,
+                             camera_command* replaced, bool* has_replaced)
+{
+    std::deque<camera_command>::iterator it;
+    std::deque<camera_command>::reverse_iterator rit;
+    const camera_command* newest;
+    camera_command command;
+    int r = CAMERA_COMMAND_QUEUED;
+
+    _parse(msg, &command);
+    *has_replaced = false;
+    pthread_mutex_lock(&_lock);
+    do {
+        // first, the worker stays busy for a while after the final ack
+        if (_find_result(command, now_ms, result)) {
+            ALOGD("command %d from %d/%d is done already, result %d", command.command,
+                  msg.sysid, msg.compid, *result);
+            r = CAMERA_COMMAND_REPLAY;
+            break;
+        }
+        // a later command of the kind can undo an earlier one, as a stop
+        // queued behind a running start, so a resend is only compared with
+        // the newest of its kind; commands of no kind stand alone
+        newest = nullptr;
+        for (rit = _commands.rbegin(); rit != _commands.rend(); ++rit) {
+            if (command.kind == CAMERA_COMMAND_KIND_NONE ? _is_duplicate(*rit, command) :
+                                                           rit->kind == command.kind) {
+                newest = &*rit;
+                break;
+            }
+        }
+        if (newest != nullptr && _is_duplicate(*newest, command)) {
+            ALOGD("command %d from %d/%d is queued already", command.command,
+                  msg.sysid, msg.compid);
+            r = CAMERA_COMMAND_DUPLICATE;
+            break;
+        }
+        if (newest == nullptr && _busy &&
+            (command.kind == CAMERA_COMMAND_KIND_NONE || _running.kind == command.kind) &&
+            _is_duplicate(_running, command)) {
+            ALOGD("command %d from %d/%d is running already", command.command,
+                  msg.sysid, msg.compid);
+            r = CAMERA_COMMAND_DUPLICATE;
+            break;
+        }
+        // a queued start is replaced by a newer start, never by a stop
+        if (command.kind != CAMERA_COMMAND_KIND_NONE) {
+            for (it = _commands.begin(); it != _commands.end(); ++it) {
+                if (it->kind == command.kind && it->command == command.command) {
+                    break;
+                }
+            }
+            if (it != _commands.end()) {
+                ALOGD("command %d replaces queued command %d", command.command, it->command);
+                *replaced = *it;
+                *has_replaced = true;
+                _commands.erase(it);
+            }
+        }
+        if (_commands.size() >= CAMERA_COMMAND_QUEUE_DEPTH) {
+            ALOGW("command queue full, refusing command %d", command.command);
+            r = CAMERA_COMMAND_FULL;
+            break;
+        }
+        _commands.push_back(command);
+        pthread_cond_signal(&_cond);
+    } while (0);
+    pthread_mutex_unlock(&_lock);
+    return r;
+}
+
+int CameraCommandQueue::pop(camera_command* command, uint32_t idle_ms)
+{
+    struct timespec deadline;
+    int r = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += idle_ms / 1000;
+    deadline.tv_nsec += (idle_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&_lock);
+    _busy = false;
+    while (_commands.empty() && !_closed && !_kicked && r == 0) {
+        r = pthread_cond_timedwait(&_cond, &_lock, &deadline);
+    }
+    if (_closed) {
+        pthread_mutex_unlock(&_lock);
+        return CAMERA_POP_CLOSED;
+    }
+    if (_commands.empty() || _kicked) {
+        _kicked = false;
+        pthread_mutex_unlock(&_lock);
+        return CAMERA_POP_IDLE;
+    }
+    *command = _commands.front();
+    _commands.pop_front();
+    _running = *command;
+    _busy = true;
+    _cancelled = false;
+    _forget_result(*command);
+    pthread_mutex_unlock(&_lock);
+    return CAMERA_POP_COMMAND;
+}
+
+bool CameraCommandQueue::peek(camera_command* command)
+{
+    bool found;
+
+    pthread_mutex_lock(&_lock);
+    found = !_commands.empty();
+    if (found) {
+        *command = _commands.front();
+    }
+    pthread_mutex_unlock(&_lock);
+    return found;
+}
+
+void CameraCommandQueue::kick()
+{
+    pthread_mutex_lock(&_lock);
+    _kicked = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+}
+
+int CameraCommandQueue::cancel(uint16_t command, uint8_t sys_id, uint8_t comp_id,
+                               camera_command* removed)
+{
+    std::deque<camera_command>::iterator it;
+    int r = CAMERA_CANCEL_NONE;
+
+    pthread_mutex_lock(&_lock);
+    for (it = _commands.begin(); it != _commands.end(); ++it) {
+        if (it->msg.msgid == MAVLINK_MSG_ID_COMMAND_LONG && it->command == command &&
+            it->msg.sysid == sys_id && it->msg.compid == comp_id) {
+            break;
+        }
+    }
+    if (it != _commands.end()) {
+        *removed = *it;
+        _commands.erase(it);
+        r = CAMERA_CANCEL_REMOVED;
+    } else if (_busy && _running.msg.msgid == MAVLINK_MSG_ID_COMMAND_LONG &&
+               _running.command == command && _running.msg.sysid == sys_id &&
+               _running.msg.compid == comp_id) {
+        _cancelled = true;
+        r = CAMERA_CANCEL_RUNNING;
+    }
+    pthread_mutex_unlock(&_lock);
+    return r;
+}
+
+bool CameraCommandQueue::is_cancelled()
+{
+    bool cancelled;
+
+    pthread_mutex_lock(&_lock);
+    cancelled = _busy && _cancelled;
+    pthread_mutex_unlock(&_lock);
+    return cancelled;
+}
+
+void CameraCommandQueue::close()
+{
+    pthread_mutex_lock(&_lock);
+    _closed = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+}
+
+void CameraCommandQueue::record_result(uint16_t command, uint8_t sys_id, uint8_t comp_id,
+                                       uint8_t result, uint64_t now_ms)
+{
+    camera_command_result* r;
+
+    pthread_mutex_lock(&_lock);
+    r = &_results[_results_next];
+    r->command = command;
+    r->sys_id = sys_id;
+    r->comp_id = comp_id;
+    r->result = result;
+    r->time_ms = now_ms;
+    _results_next = (_results_next + 1) % CAMERA_COMMAND_RESULTS;
+    pthread_mutex_unlock(&_lock);
+}
+
+bool CameraCommandQueue::find_result(const mavlink_message_t& msg, uint64_t now_ms,
+                                     uint8_t* result)
+{
+    camera_command command;
+    bool found;
+
+    _parse(msg, &command);
+    pthread_mutex_lock(&_lock);
+    found = _find_result(command, now_ms, result);
+    pthread_mutex_unlock(&_lock);
+    return found;
+}
+
+bool CameraCommandQueue::is_same_request(const camera_command& command,
+                                         const mavlink_message_t& msg)
+{
+    camera_command other;
+
+    _parse(msg, &other);
+    return other.msg.msgid == command.msg.msgid && other.command == command.command &&
+           memcmp(other.param, command.param, sizeof(command.param)) == 0;
+}
+
+void CameraCommandQueue::_parse(const mavlink_message_t& msg, camera_command* command)
+{
+    mavlink_command_long_t cmd;
+
+    bzero((void*)command, sizeof(*command));
+    command->msg = msg;
+    if (msg.msgid == MAVLINK_MSG_ID_SET_VIDEO_STREAM_SETTINGS) {
+        command->kind = CAMERA_COMMAND_KIND_STREAM_SETTINGS;
+        return;
+    }
+    if (msg.msgid != MAVLINK_MSG_ID_COMMAND_LONG) {
+        return;
+    }
+    mavlink_msg_command_long_decode(&msg, &cmd);
+    command->command = cmd.command;
+    command->confirmation = cmd.confirmation;
+    command->param[0] = cmd.param1;
+    command->param[1] = cmd.param2;
+    command->param[2] = cmd.param3;
+    command->param[3] = cmd.param4;
+    command->param[4] = cmd.param5;
+    command->param[5] = cmd.param6;
+    command->param[6] = cmd.param7;
+    switch (cmd.command) {
+    case MAV_CMD_SET_CAMERA_MODE:
+        command->kind = CAMERA_COMMAND_KIND_MODE;
+        break;
+    case MAV_CMD_VIDEO_START_STREAMING:
+    case MAV_CMD_VIDEO_STOP_STREAMING:
+        command->kind = CAMERA_COMMAND_KIND_STREAMING;
+        break;
+    case MAV_CMD_VIDEO_START_CAPTURE:
+    case MAV_CMD_VIDEO_STOP_CAPTURE:
+        command->kind = CAMERA_COMMAND_KIND_RECORDING;
+        break;
+    default:
+        break;
+    }
+}
+
+// A raised confirmation marks a resend, the same parameters a second press
+// that would change nothing.
+bool CameraCommandQueue::_is_duplicate(const camera_command& queued, const camera_command& command)
+{
+    if (queued.msg.msgid != command.msg.msgid || queued.msg.sysid != command.msg.sysid ||
+        queued.msg.compid != command.msg.compid) {
+        return false;
+    }
+    if (command.msg.msgid != MAVLINK_MSG_ID_COMMAND_LONG) {
+        return queued.msg.len == command.msg.len &&
+               memcmp(_MAV_PAYLOAD(&queued.msg), _MAV_PAYLOAD(&command.msg), command.msg.len) == 0;
+    }
+    if (queued.command != command.command) {
+        return false;
+    }
+    return command.confirmation > queued.confirmation ||
+           memcmp(queued.param, command.param, sizeof(command.param)) == 0;
+}
+
+// a result of an earlier run must not answer resends of this one
+void CameraCommandQueue::_forget_result(const camera_command& command)
+{
+    int i;
+
+    for (i = 0; i < CAMERA_COMMAND_RESULTS; i++) {
+        if (_results[i].command == command.command && _results[i].sys_id == command.msg.sysid &&
+            _results[i].comp_id == command.msg.compid) {
+            _results[i].command = 0;
+        }
+    }
+}
+
+// only resends match here, a new press of a finished command runs again
+bool CameraCommandQueue::_find_result(const camera_command& command, uint64_t now_ms,
+                                      uint8_t* result)
+{
+    const camera_command_result* r;
+    int i;
+
+    if (command.msg.msgid != MAVLINK_MSG_ID_COMMAND_LONG || command.confirmation == 0) {
+        return false;
+    }
+    // newest first
+    for (i = 1; i <= CAMERA_COMMAND_RESULTS; i++) {
+        r = &_results[(_results_next + CAMERA_COMMAND_RESULTS - i) % CAMERA_COMMAND_RESULTS];
+        if (r->time_ms == 0 || now_ms - r->time_ms > CAMERA_COMMAND_RETRANSMIT_MS) {
+            break;
+        }
+        if (r->command == command.command && r->sys_id == command.msg.sysid &&
+            r->comp_id == command.msg.compid) {
+            *result = r->result;
+            return true;
+        }
+    }
+    return false;
+}
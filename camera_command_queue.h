@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include "mavlink.h"
+
+#define CAMERA_COMMAND_QUEUE_DEPTH      8
+#define CAMERA_COMMAND_RESULTS          8
+#define CAMERA_COMMAND_RETRANSMIT_MS    5000    // how long a result answers retransmits
+
+// commands of the same kind replace each other while queued
+enum {
+    CAMERA_COMMAND_KIND_NONE = 0,           // never replaced
+    CAMERA_COMMAND_KIND_MODE,
+    CAMERA_COMMAND_KIND_STREAM_SETTINGS,
+    CAMERA_COMMAND_KIND_STREAMING,          // start and stop streaming
+    CAMERA_COMMAND_KIND_RECORDING,          // start and stop video capture
+};
+
+enum {
+    CAMERA_COMMAND_QUEUED = 0,
+    CAMERA_COMMAND_DUPLICATE,               // already queued or running, dropped
+    CAMERA_COMMAND_REPLAY,                  // already done, ack the stored result
+    CAMERA_COMMAND_FULL,
+};
+
+enum {
+    CAMERA_POP_COMMAND = 0,
+    CAMERA_POP_IDLE,                        // no command within the wait, or kicked
+    CAMERA_POP_CLOSED,
+};
+
+enum {
+    CAMERA_CANCEL_NONE = 0,
+    CAMERA_CANCEL_REMOVED,                  // taken out of the queue
+    CAMERA_CANCEL_RUNNING,                  // the worker gives up at its next wait
+};
+
+struct camera_command {
+    mavlink_message_t msg;
+    uint16_t command;                       // MAV_CMD, 0 if msg is no COMMAND_LONG
+    uint8_t confirmation;
+    int kind;
+    float param[7];
+};
+
+struct camera_command_result {
+    uint16_t command;
+    uint8_t sys_id;
+    uint8_t comp_id;
+    uint8_t result;
+    uint64_t time_ms;
+};
+
+/*
+ * Commands for the camera worker. GCS apps resend a COMMAND_LONG with a
+ * raised confirmation when the ack is late, and users press buttons more
+ * than once, so a command from the same sender that is queued or running
+ * already is dropped, and one answered lately gets its stored result
+ * again. A newer command of the same kind replaces a queued one, the
+ * caller acks the replaced command. Past CAMERA_COMMAND_QUEUE_DEPTH new
+ * commands are refused. A cancel takes a queued command out, or flags the
+ * running one for the worker to give up on.
+ */
+class CameraCommandQueue {
+public:
+    CameraCommandQueue();
+    ~CameraCommandQueue();
+    // result is set for CAMERA_COMMAND_REPLAY, replaced for a command that
+    // was taken out of the queue by this one
+    int push(const mavlink_message_t& msg, uint64_t now_ms, uint8_t* result,
+             camera_command* replaced, bool* has_replaced);
+    // true if msg asks for the same as command, whoever sent it
+    static bool is_same_request(const camera_command& command, const mavlink_message_t& msg);
+    // waits up to idle_ms for a command
+    int pop(camera_command* command, uint32_t idle_ms);
+    bool peek(camera_command* command);
+    // makes a waiting pop return CAMERA_POP_IDLE at once
+    void kick();
+    // removed is set for CAMERA_CANCEL_REMOVED
+    int cancel(uint16_t command, uint8_t sys_id, uint8_t comp_id, camera_command* removed);
+    bool is_cancelled();
+    void close();
+    void record_result(uint16_t command, uint8_t sys_id, uint8_t comp_id,
+                       uint8_t result, uint64_t now_ms);
+    // for commands run outside the queue, true if msg resends one answered lately
+    bool find_result(const mavlink_message_t& msg, uint64_t now_ms, uint8_t* result);
+
+private:
+    static void _parse(const mavlink_message_t& msg, camera_command* command);
+    bool _is_duplicate(const camera_command& queued, const camera_command& command);
+    bool _find_result(const camera_command& command, uint64_t now_ms, uint8_t* result);
+    void _forget_result(const camera_command& command);
+
+    pthread_mutex_t _lock;
+    pthread_cond_t _cond;
+    std::deque<camera_command> _commands;
+    camera_command _running;
+    bool _busy;
+    bool _kicked;
+    bool _cancelled;                        // the running command is cancelled
+    bool _closed;
+    camera_command_result _results[CAMERA_COMMAND_RESULTS];
+    int _results_next;
+};
@@ -17,25 +17,98 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/un.h>
+#include <sys/timerfd.h>
 #include <cutils/properties.h>
 #include "mavlink.h"
 #include "config.h"
+#include "telemetry_budget.h"
 #include "camera_control.h"
 
 #undef LOG_TAG
 #define LOG_TAG "CameraControl"
 #define MAX_RTSP_URI_LEN 100
 #define CAMERA_CONTROL_SOCKET_NAME "cameracontrol"
+#define HEARTBEAT_INTERVAL_MS 1000
+#define HEARTBEAT_MAX_INTERVAL_MS 3000
+#define CAMERA_OPEN_RETRY_MS 1000
+#define CAMERA_OPEN_RETRY_MAX_MS 16000
+#define PROGRESS_INTERVAL_MS 1000           // IN_PROGRESS repeat while the camera is busy
+#define PROGRESS_UNKNOWN 255
+#define SNAPSHOT_REFRESH_MS 1000            // while the worker is idle
+#define CAMERA_CAPTURES_IN_FLIGHT 2         // pictures taken whose image did not come yet
+#define CAMERA_CAPTURE_MAX_INTERVAL_S 3600  // longer intervals and counts are cut
+#define CAMERA_CAPTURE_MAX_COUNT 100000
 
-static int g_image_index = -1;
+// commands that wait on a busy camera, acked IN_PROGRESS until they finish
+static bool is_slow_command(int cmd)
+{
+    switch (cmd) {
+    case MAV_CMD_SET_CAMERA_MODE:
+    case MAV_CMD_VIDEO_START_STREAMING:
+    case MAV_CMD_VIDEO_STOP_STREAMING:
+    case MAV_CMD_VIDEO_START_CAPTURE:
+    case MAV_CMD_VIDEO_STOP_CAPTURE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// the preview size of a snapshot, or the one the hd property asks for when
+// they do not match; false in that case
+static bool get_stream_size(const camera_snapshot& snapshot, int* width, int* height)
+{
+    char prop_value[PROP_VALUE_MAX];
+    int isHd;
+
+    *width = snapshot.preview_width;
+    *height = snapshot.preview_height;
+    property_get("persist.sys.camera.hd", prop_value, "0");
+    isHd = atoi(prop_value);
+    if ((isHd && *width == 1920) || (!isHd && *width == 1280)) {
+        return true;
+    }
+    if (isHd) {
+        *width = 1920;
+        *height = 1080;
+    } else {
+        *width = 1280;
+        *height = 720;
+    }
+    return false;
+}
 
 CameraControl::CameraControl() : ModuleThread{"CameraControl"}
     , _src_sys_id(0)
     , _src_comp_id(0)
     , _preview_width(0)
     , _preview_height(0)
+    , _reconfig_pending(false)
+    , _staged_width(-1)
+    , _staged_height(-1)
+    , _mode_ack_pending(false)
+    , _mode_ack_sys_id(0)
+    , _mode_ack_comp_id(0)
+    , _cmd_sys_id(0)
+    , _cmd_comp_id(0)
+    , _progress_cmd(0)
+    , _progress_sys_id(0)
+    , _progress_comp_id(0)
+    , _progress(0)
+    , _progress_ms(0)
+    , _worker(this)
     , _is_camera_ready(false)
-    , _timer_id(NULL)
+    , _camera_opening(false)
+    , _open_retry_ms(CAMERA_OPEN_RETRY_MS)
+    , _next_open_ms(0)
+    , _heartbeat_timer_fd(-1)
+    , _capture_timer_fd(-1)
+    , _capture_fd(-1)
+    , _capture_interval_ms(0)
+    , _capture_remaining(0)
+    , _capture_next_ms(0)
+    , _captures_in_flight(0)
+    , _image_index(-1)
 {
     char prop_value[PROP_VALUE_MAX];
     timeval tv;
@@ -43,6 +116,7 @@ CameraControl::CameraControl() : ModuleThread{"CameraControl"}
     _uid = (uint8_t)tv.tv_usec;
     _uid = (_uid << 16) | getpid();
     _cam_service = CameraService::get_instance();
+    pthread_mutex_init(&_snapshot_lock, NULL);
     if (Config::get_instance()->get_support_multiple_camera()) {
         _cam_service->get_camera_id(&_camera_id, &_camera_count);
     } else {
@@ -53,6 +127,11 @@ CameraControl::CameraControl() : ModuleThread{"CameraControl"}
     ALOGD("uid is %u, cam count is %u", _uid, _camera_count);
     _system_id = Config::get_instance()->get_camera_system_id();
     _comp_id = Config::get_instance()->get_camera_comp_id();
+    _refresh_snapshot();
+    _heartbeat_budget = TelemetryBudget::get_instance()->add_producer(
+        "camera_heartbeat", TELEMETRY_PRIORITY_HIGH,
+        MAVLINK_NUM_NON_PAYLOAD_BYTES + MAVLINK_MSG_ID_HEARTBEAT_LEN,
+        HEARTBEAT_INTERVAL_MS, HEARTBEAT_MAX_INTERVAL_MS);
 
     _router_fd = _get_domain_socket(CAMERA_CONTROL_SOCKET_NAME,
                                     TYPE_DOMAIN_SOCK_ABSTRACT);
@@ -61,71 +140,116 @@ CameraControl::CameraControl() : ModuleThread{"CameraControl"}
     } else {
         _add_read_fd(_router_fd, TYPE_DATAGRAM_SOCK_FD);
     }
-    _start_heartbeat();
+    if (!_add_timer(&_heartbeat_timer_fd, HEARTBEAT_INTERVAL_MS)) {
+        ALOGE("fail to add heartbeat timer");
+    }
+    // armed for the next picture of a sequence only
+    _capture_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (_capture_timer_fd < 0 || !_add_read_fd(_capture_timer_fd, TYPE_TIMER_FD)) {
+        ALOGE("fail to add capture timer");
+    }
+    // read like a timer, it counts the finished captures
+    _capture_fd = _cam_service->get_capture_fd();
+    if (_capture_fd < 0 || !_add_read_fd(_capture_fd, TYPE_TIMER_FD)) {
+        ALOGE("fail to add capture fd");
+    }
 }
 
 void CameraControl::broadcast_heartbeat()
 {
     mavlink_message_t msg;
+    uint8_t status;
 
+    // the GCS sees the camera while it is still coming up
+    if (!_is_camera_ready) {
+        status = MAV_STATE_BOOT;
+    } else {
+        status = Config::get_instance()->get_support_camera_capture() ? MAV_STATE_ACTIVE : 0;
+    }
     mavlink_msg_heartbeat_pack(_system_id, _comp_id, &msg, MAV_TYPE_GENERIC,
-                               MAV_AUTOPILOT_INVALID, MAV_MODE_PREFLIGHT, _uid,
-                               Config::get_instance()->get_support_camera_capture() ? MAV_STATE_ACTIVE : 0);
+                               MAV_AUTOPILOT_INVALID, MAV_MODE_PREFLIGHT, _uid, status);
 
     _send_mavlink_msg(&msg);
 }
 
 bool CameraControl::camera_ready()
+{
+    return _is_camera_ready;
+}
+
+// The open runs on the camera thread, the reactor only starts it and picks
+// up the result on a later tick. A failed open is retried with backoff.
+void CameraControl::_poll_camera_open(uint64_t now_ms)
 {
     int r;
-    if (!_is_camera_ready) {
-        r = _cam_service->open_camera();
+
+    if (_is_camera_ready) {
+        return;
+    }
+    if (_camera_opening) {
+        if (!_cam_service->open_camera_done(&r)) {
+            return;
+        }
+        _camera_opening = false;
         if (r == 0) {
+            ALOGD("camera ready");
             _is_camera_ready = true;
-        } else {
-            ALOGE("camera not ready, open return %d!", r);
+            _commands.kick();
+            _open_retry_ms = CAMERA_OPEN_RETRY_MS;
+            return;
         }
+        ALOGE("camera not ready, open return %d, retry in %u ms", r, _open_retry_ms);
+        _next_open_ms = now_ms + _open_retry_ms;
+        _open_retry_ms = _open_retry_ms * 2 > CAMERA_OPEN_RETRY_MAX_MS ?
+                         CAMERA_OPEN_RETRY_MAX_MS : _open_retry_ms * 2;
+        return;
     }
-    return _is_camera_ready;
-}
-
-void CameraControl::_heartbeat_timeout(union sigval v)
-{
-    CameraControl* cam_control = (CameraControl*)v.sival_ptr;
-    if (cam_control->camera_ready()) {
-        cam_control->broadcast_heartbeat();
+    if (now_ms >= _next_open_ms) {
+        _camera_opening = _cam_service->open_camera_async();
     }
 }
 
-bool CameraControl::_start_heartbeat()
+bool CameraControl::_handle_timeout(int fd)
 {
-    struct sigevent evp;
-    memset(&evp, 0, sizeof(struct sigevent));
-
-    evp.sigev_value.sival_ptr = (void*)this;
-    evp.sigev_notify = SIGEV_THREAD;
-    evp.sigev_notify_function = _heartbeat_timeout;
+    uint64_t now_ms = _get_monotonic_ms();
 
-    if (timer_create(CLOCK_MONOTONIC, &evp, &_timer_id) == -1)
-    {
-        ALOGE("fail to timer_create");
+    if (fd == _capture_fd) {
+        _handle_capture_results(now_ms);
+        return true;
+    }
+    if (fd == _capture_timer_fd) {
+        _schedule_captures(now_ms);
+        return true;
+    }
+    if (fd != _heartbeat_timer_fd) {
         return false;
     }
+    _poll_camera_open(now_ms);
+    _cam_service->expire_captures(now_ms);
+    // on a starved uplink every other tick or so is skipped
+    if (TelemetryBudget::get_instance()->allow(_heartbeat_budget, now_ms)) {
+        broadcast_heartbeat();
+    }
+    return true;
+}
 
-    struct itimerspec it;
-    it.it_interval.tv_sec = 1;
-    it.it_interval.tv_nsec = 0;
-    it.it_value.tv_sec = 1;
-    it.it_value.tv_nsec = 0;
-
-    if (timer_settime(_timer_id, 0, &it, NULL) == -1)
-    {
-        ALOGE("fail to timer_settime");
+bool CameraControl::start()
+{
+    if (!_worker.start_thread()) {
+        ALOGE("fail to start camera command worker");
         return false;
     }
-    return true;
+    return ModuleThread::start();
 }
 
+void CameraControl::stop()
+{
+    _commands.close();
+    ModuleThread::stop();
+}
+
+// Queries and photos are handled here at once, commands changing the
+// camera go to the worker, so a slow one does not hold the queries up.
 bool CameraControl::_process_data(int fd, uint8_t* buf, int len,
                                   struct sockaddr* src_addr, int addrlen)
 {
@@ -155,14 +279,144 @@ bool CameraControl::_process_data(int fd, uint8_t* buf, int len,
             ALOGD("command received: REQUEST_CAMERA_SETTINGS");
             _handle_camera_settings_request();
             break;
-        case MAV_CMD_SET_CAMERA_MODE:
-            ALOGD("command received: SET_CAMERA_MODE %d", (int)cmd.param2);
-            _handle_set_camera_mode((int)cmd.param2);
-            break;
         case MAV_CMD_REQUEST_STORAGE_INFORMATION:
             ALOGD("command received: REQUEST_STORAGE_INFORMATION");
             _handle_storage_info_request();
             break;
+        case MAV_CMD_REQUEST_CAMERA_CAPTURE_STATUS:
+            ALOGD("command received: REQUEST_CAMERA_CAPTURE_STATUS");
+            _handle_request_capture_status();
+            break;
+        case MAV_CMD_SET_CAMERA_MODE:
+        case MAV_CMD_VIDEO_START_STREAMING:
+        case MAV_CMD_VIDEO_STOP_STREAMING:
+        case MAV_CMD_VIDEO_START_CAPTURE:
+        case MAV_CMD_VIDEO_STOP_CAPTURE:
+            _queue_command(&msg);
+            break;
+        case MAV_CMD_IMAGE_START_CAPTURE:
+            ALOGD("command received: IMAGE_START_CAPTURE");
+            _handle_image_start_capture(&msg);
+            break;
+        case MAV_CMD_IMAGE_STOP_CAPTURE:
+            ALOGD("command received: IMAGE_STOP_CAPTURE");
+            _handle_image_stop_capture(&msg);
+            break;
+        default:
+            ALOGD("Command %d unhandled. Discarding.", cmd.command);
+        }
+    } else if (msg.msgid == MAVLINK_MSG_ID_SET_VIDEO_STREAM_SETTINGS) {
+        _queue_command(&msg);
+#ifdef MAVLINK_MSG_ID_COMMAND_CANCEL
+    } else if (msg.msgid == MAVLINK_MSG_ID_COMMAND_CANCEL) {
+        _handle_command_cancel(&msg);
+#endif
+    }
+    return true;
+}
+
+void CameraControl::_queue_command(mavlink_message_t* msg)
+{
+    camera_command replaced;
+    bool has_replaced;
+    uint8_t result = MAV_RESULT_ACCEPTED;
+    int cmd;
+    int r;
+
+    r = _commands.push(*msg, _get_monotonic_ms(), &result, &replaced, &has_replaced);
+    // the same request from another sender carries the replaced one on,
+    // a different one means the replaced command never runs
+    if (has_replaced && replaced.command != 0) {
+        _ack_command(replaced.command,
+                     CameraCommandQueue::is_same_request(replaced, *msg) ?
+                     MAV_RESULT_ACCEPTED : MAV_RESULT_CANCELLED,
+                     replaced.msg.sysid, replaced.msg.compid);
+    }
+    if (msg->msgid != MAVLINK_MSG_ID_COMMAND_LONG) {
+        // SET_VIDEO_STREAM_SETTINGS has no ack
+        return;
+    }
+    cmd = mavlink_msg_command_long_get_command(msg);
+    if (r == CAMERA_COMMAND_REPLAY) {
+        _send_ack_result(cmd, result, 0, msg->sysid, msg->compid);
+    } else if (r == CAMERA_COMMAND_FULL) {
+        _send_ack_result(cmd, MAV_RESULT_TEMPORARILY_REJECTED, 0, msg->sysid, msg->compid);
+    } else if (r == CAMERA_COMMAND_QUEUED && is_slow_command(cmd)) {
+        // the final ack follows once the worker is done with it
+        _send_ack_result(cmd, MAV_RESULT_IN_PROGRESS, 0, msg->sysid, msg->compid);
+    } else if (r == CAMERA_COMMAND_DUPLICATE && is_slow_command(cmd)) {
+        _send_ack_result(cmd, MAV_RESULT_IN_PROGRESS, PROGRESS_UNKNOWN, msg->sysid, msg->compid);
+    }
+}
+
+#ifdef MAVLINK_MSG_ID_COMMAND_CANCEL
+void CameraControl::_handle_command_cancel(mavlink_message_t* msg)
+{
+    mavlink_command_cancel_t cancel;
+    camera_command removed;
+    int r;
+
+    mavlink_msg_command_cancel_decode(msg, &cancel);
+    r = _commands.cancel(cancel.command, msg->sysid, msg->compid, &removed);
+    if (r == CAMERA_CANCEL_REMOVED) {
+        ALOGD("queued command %d cancelled", cancel.command);
+        _ack_command(cancel.command, MAV_RESULT_CANCELLED, msg->sysid, msg->compid);
+    } else if (r == CAMERA_CANCEL_RUNNING) {
+        // acked by the worker when it gives up
+        ALOGD("running command %d cancelled", cancel.command);
+    } else {
+        ALOGD("no command %d to cancel", cancel.command);
+    }
+}
+#endif
+
+void CameraCommandWorker::_thread_entry()
+{
+    _control->_run_commands();
+}
+
+void CameraControl::_run_commands()
+{
+    camera_command command;
+    camera_command next;
+    bool more_reconfig;
+    int r;
+
+    while ((r = _commands.pop(&command, SNAPSHOT_REFRESH_MS)) != CAMERA_POP_CLOSED) {
+        // the camera may change without a command, e.g. when it opens
+        if (r == CAMERA_POP_IDLE) {
+            _refresh_snapshot();
+            continue;
+        }
+        if (is_slow_command(command.command)) {
+            _begin_progress(command.command, command.msg.sysid, command.msg.compid);
+        }
+        _dispatch_command(&command.msg);
+        // settings changes batch up while more of them are queued, anything
+        // else has to see them applied
+        if (_reconfig_pending) {
+            more_reconfig = _commands.peek(&next) && _is_reconfigure_message(&next.msg);
+            if (!more_reconfig) {
+                _commit_reconfigure();
+            }
+        }
+        _progress_cmd = 0;
+        _refresh_snapshot();
+    }
+}
+
+void CameraControl::_dispatch_command(mavlink_message_t* msg)
+{
+    _cmd_sys_id = msg->sysid;
+    _cmd_comp_id = msg->compid;
+    if (msg->msgid == MAVLINK_MSG_ID_COMMAND_LONG) {
+        mavlink_command_long_t cmd;
+        mavlink_msg_command_long_decode(msg, &cmd);
+        switch (cmd.command) {
+        case MAV_CMD_SET_CAMERA_MODE:
+            ALOGD("command received: SET_CAMERA_MODE %d", (int)cmd.param2);
+            _handle_set_camera_mode((int)cmd.param2);
+            break;
         case MAV_CMD_VIDEO_START_STREAMING:
             ALOGD("command received: START_STREAMING %d", (int)cmd.param1);
             _handle_video_start_streaming((int)cmd.param1);
@@ -179,31 +433,204 @@ bool CameraControl::_process_data(int fd, uint8_t* buf, int len,
             ALOGD("command received: STOP_CAPTURE");
             _handle_video_stop_recording();
             break;
-        case MAV_CMD_IMAGE_START_CAPTURE:
-            ALOGD("command received: IMAGE_START_CAPTURE");
-            _handle_capture_photo_image();
-            break;
-        case MAV_CMD_REQUEST_CAMERA_CAPTURE_STATUS:
-            ALOGD("command received: REQUEST_CAMERA_CAPTURE_STATUS");
-            _handle_request_capture_status();
-            break;
         default:
-            ALOGD("Command %d unhandled. Discarding.", cmd.command);
+            break;
         }
-    } else if (msg.msgid == MAVLINK_MSG_ID_SET_VIDEO_STREAM_SETTINGS) {
+    } else if (msg->msgid == MAVLINK_MSG_ID_SET_VIDEO_STREAM_SETTINGS) {
         ALOGD("command received: SET_VIDEO_STREAM_SETTINGS");
-        _handle_camera_set_video_stream_settings(&msg);
+        _handle_camera_set_video_stream_settings(msg);
+    }
+}
+
+// Called by the worker after each command and now and then while it is
+// idle. It asks the camera thread, so never from the reactor.
+void CameraControl::_refresh_snapshot()
+{
+    camera_snapshot snapshot;
+
+    snapshot.state = -1;
+    snapshot.preview_width = 0;
+    snapshot.preview_height = 0;
+    _cam_service->get_camera_state(&snapshot.state);
+    _cam_service->get_camera_preview_size(&snapshot.preview_width, &snapshot.preview_height);
+    snapshot.camera_id = _camera_id;
+    pthread_mutex_lock(&_snapshot_lock);
+    _snapshot = snapshot;
+    pthread_mutex_unlock(&_snapshot_lock);
+    // a camera switch restores the size the stream is announced with
+    get_stream_size(snapshot, &_preview_width, &_preview_height);
+}
+
+// what the worker saw last, the reactor does not wait for the camera
+void CameraControl::_get_snapshot(camera_snapshot* snapshot)
+{
+    pthread_mutex_lock(&_snapshot_lock);
+    *snapshot = _snapshot;
+    pthread_mutex_unlock(&_snapshot_lock);
+}
+
+bool CameraControl::_is_reconfigure_message(mavlink_message_t* msg)
+{
+    if (msg->msgid == MAVLINK_MSG_ID_SET_VIDEO_STREAM_SETTINGS) {
+        return true;
+    }
+    return msg->msgid == MAVLINK_MSG_ID_COMMAND_LONG &&
+           mavlink_msg_command_long_get_command(msg) == MAV_CMD_SET_CAMERA_MODE;
+}
+
+// Applies the staged settings with one setParameters. The preview is only
+// restarted if it runs and the settings differ from the camera's.
+void CameraControl::_commit_reconfigure()
+{
+    bool changed = false;
+    bool previewing = false;
+    bool success = false;
+    int state = -1;
+
+    _reconfig_pending = false;
+    if (_mode_ack_pending) {
+        _begin_progress(MAV_CMD_SET_CAMERA_MODE, _mode_ack_sys_id, _mode_ack_comp_id);
+    }
+    do {
+        if (_cam_service->prepare_reconfigure(&changed) != 0) {
+            ALOGE("failed to read camera parameters");
+            break;
+        }
+        if (!changed) {
+            ALOGD("camera already has the requested settings");
+            success = true;
+            break;
+        }
+        _cam_service->get_camera_state(&state);
+        if (state == CAM_STATE_ZSL_PREVIEW || state == CAM_STATE_VIDEO_PREVIEW) {
+            previewing = true;
+        } else if (state != CAM_STATE_OPEN) {
+            ALOGE("reconfigure camera in wrong state %d", state);
+            break;
+        }
+        if (previewing && _stop_preview_waiton_busy() != 0) {
+            ALOGE("failed to stop preview");
+            break;
+        }
+        _send_progress(33);
+        success = (_cam_service->commit_reconfigure() == 0);
+        ALOGD("reconfigure camera success:%d", success);
+        _send_progress(66);
+        if (previewing && _start_preview_waiton_busy() != 0) {
+            ALOGE("restart preview failed");
+        }
+    } while (0);
+    if (!success) {
+        _cam_service->discard_reconfigure();
+    }
+
+    if (_staged_width >= 0) {
+        if (success) {
+            _preview_width = _staged_width;
+            _preview_height = _staged_height;
+            // set propery for rtsp server to set correct preview size
+            if (_preview_width == 1920 && _preview_height == 1080) {
+                property_set("persist.sys.camera.hd", "1");
+            } else {
+                property_set("persist.sys.camera.hd", "0");
+            }
+            ALOGD("successfully set preview size to %d x %d", _preview_width, _preview_height);
+        } else {
+            ALOGE("set preview size failed %d x %d", _staged_width, _staged_height);
+        }
+        _staged_width = -1;
+        _staged_height = -1;
+    }
+    if (_mode_ack_pending) {
+        _mode_ack_pending = false;
+        _ack_command(MAV_CMD_SET_CAMERA_MODE, _command_result(success),
+                     _mode_ack_sys_id, _mode_ack_comp_id);
+        ALOGD("ack sent with result %d: SET_CAMERA_MODE", success);
     }
-    return true;
 }
 
 void CameraControl::_send_ack(int cmd, bool success)
+{
+    _send_ack_result(cmd, success ? MAV_RESULT_ACCEPTED : MAV_RESULT_FAILED, 0,
+                     _src_sys_id, _src_comp_id);
+}
+
+// acks a command run by the worker to its sender
+void CameraControl::_send_command_ack(int cmd, bool success)
+{
+    _ack_command(cmd, _command_result(success), _cmd_sys_id, _cmd_comp_id);
+}
+
+// a command that failed because it was cancelled reports that instead
+uint8_t CameraControl::_command_result(bool success)
+{
+    if (success) {
+        return MAV_RESULT_ACCEPTED;
+    }
+#ifdef MAVLINK_MSG_ID_COMMAND_CANCEL
+    if (_commands.is_cancelled()) {
+        return MAV_RESULT_CANCELLED;
+    }
+#endif
+    return MAV_RESULT_FAILED;
+}
+
+void CameraControl::_begin_progress(int cmd, uint8_t target_sys_id, uint8_t target_comp_id)
+{
+    _progress_cmd = cmd;
+    _progress_sys_id = target_sys_id;
+    _progress_comp_id = target_comp_id;
+    _progress = 0;
+    _progress_ms = _get_monotonic_ms();
+}
+
+// progress of the slow command the worker runs, in percent
+void CameraControl::_send_progress(uint8_t progress)
+{
+    if (_progress_cmd == 0) {
+        return;
+    }
+    _progress = progress;
+    _progress_ms = _get_monotonic_ms();
+    _send_ack_result(_progress_cmd, MAV_RESULT_IN_PROGRESS, progress,
+                     _progress_sys_id, _progress_comp_id);
+}
+
+// repeats the last progress while the camera keeps the command waiting
+void CameraControl::_refresh_progress()
+{
+    if (_progress_cmd != 0 && _get_monotonic_ms() - _progress_ms >= PROGRESS_INTERVAL_MS) {
+        _send_progress(_progress);
+    }
+}
+
+// one round of waiting on a busy camera, false if the command was cancelled
+bool CameraControl::_wait_busy(const char* what)
+{
+    if (_commands.is_cancelled()) {
+        ALOGD("%s cancelled", what);
+        return false;
+    }
+    ALOGD("%s busy", what);
+    usleep(100 * 1000);
+    _refresh_progress();
+    return true;
+}
+
+// the result is kept, so a resend of the command is answered without running it
+void CameraControl::_ack_command(int cmd, uint8_t result, uint8_t target_sys_id, uint8_t target_comp_id)
+{
+    _commands.record_result(cmd, target_sys_id, target_comp_id, result, _get_monotonic_ms());
+    _send_ack_result(cmd, result, 0, target_sys_id, target_comp_id);
+}
+
+void CameraControl::_send_ack_result(int cmd, uint8_t result, uint8_t progress,
+                                     uint8_t target_sys_id, uint8_t target_comp_id)
 {
     mavlink_message_t msg;
 
-    mavlink_msg_command_ack_pack(_system_id, _comp_id, &msg, cmd,
-                                 success ? MAV_RESULT_ACCEPTED : MAV_RESULT_FAILED,
-                                 0, 0, _src_sys_id, _src_comp_id);
+    mavlink_msg_command_ack_pack(_system_id, _comp_id, &msg, cmd, result,
+                                 progress, 0, target_sys_id, target_comp_id);
 
     _send_mavlink_msg(&msg);
 }
@@ -252,34 +679,24 @@ void CameraControl::_handle_camera_video_stream_request()
     mavlink_message_t msg;
     char rtsp_uri[MAX_RTSP_URI_LEN+1];
     char* local_ip = Config::get_instance()->get_video_stream_ip_address();
+    camera_snapshot snapshot;
+    int width;
+    int height;
 
-    _cam_service->get_camera_preview_size(&_preview_width, &_preview_height);
-
-    char prop_value[PROP_VALUE_MAX];
-    property_get("persist.sys.camera.hd", prop_value, "0");
-    int isHd = atoi(prop_value);
-    int state = -1;
-    if ((isHd && _preview_width != 1920) || (!isHd && _preview_width != 1280)) {
-        _cam_service->get_camera_state(&state);
-        if (state < CAM_STATE_ZSL_PREVIEW) {
-            ALOGD("camera preview size is not set yet, use property value %d", isHd);
+    _get_snapshot(&snapshot);
+    if (!get_stream_size(snapshot, &width, &height)) {
+        if (snapshot.state < CAM_STATE_ZSL_PREVIEW) {
+            ALOGD("camera preview size is not set yet, use %d x %d", width, height);
         } else {
             ALOGE("camera preview size is not consistent with property value!");
         }
-        if (isHd) {
-            _preview_width = 1920;
-            _preview_height = 1080;
-        } else {
-            _preview_width = 1280;
-            _preview_height = 720;
-        }
     }
 
     snprintf(rtsp_uri, MAX_RTSP_URI_LEN, "rtsp://%s:8554/H264Video", local_ip);
 
     mavlink_msg_video_stream_information_pack(
-                _system_id, _comp_id, &msg, _camera_id, 0 /* Status */,
-                0 /* FPS */, _preview_width, _preview_height, 0 /* bitrate */, 0 /* Rotation */,
+                _system_id, _comp_id, &msg, snapshot.camera_id, 0 /* Status */,
+                0 /* FPS */, width, height, 0 /* bitrate */, 0 /* Rotation */,
                 rtsp_uri);
     _send_mavlink_msg(&msg);
 }
@@ -287,50 +704,14 @@ void CameraControl::_handle_camera_video_stream_request()
 void CameraControl::_handle_camera_set_video_stream_settings(mavlink_message_t *msg)
 {
     mavlink_set_video_stream_settings_t settings;
-    int state = -1;
-    bool previewStopped = false;
 
     mavlink_msg_set_video_stream_settings_decode(msg, &settings);
 
-    _cam_service->get_camera_preview_size(&_preview_width, &_preview_height);
-    ALOGD("try to set preview size to %d x %d, now is %d x %d",
-              settings.resolution_h, settings.resolution_v,
-             _preview_width, _preview_height);
-    if (_preview_width != settings.resolution_h || _preview_height != settings.resolution_v) {
-        _cam_service->get_camera_state(&state);
-        if (state == CAM_STATE_ZSL_PREVIEW || state == CAM_STATE_VIDEO_PREVIEW) {
-            ALOGD("need to stop preview at first");
-            previewStopped = (_stop_preview_waiton_busy() == 0);
-            if (!previewStopped) {
-                ALOGE("failed to stop preview");
-                return;
-            }
-        } else if (state != CAM_STATE_OPEN) {
-            ALOGE("set preview size in wrong state %d", state);
-            return;
-        }
-
-        ALOGD("set preview size really");
-        if(_cam_service->set_camera_preview_size(settings.resolution_h, settings.resolution_v) != 0) {
-            ALOGE("set preview size failed %d x %d", settings.resolution_h, settings.resolution_v);
-        } else {
-            _preview_width = settings.resolution_h;
-            _preview_height = settings.resolution_v;
-            // set propery for rtsp server to set correct preview size
-            if (_preview_width == 1920 && _preview_height == 1080) {
-                property_set("persist.sys.camera.hd", "1");
-            } else {
-                property_set("persist.sys.camera.hd", "0");
-            }
-            ALOGD("successfully set preview size to %d x %d", _preview_width, _preview_height);
-        }
-        // restore preview
-        if (previewStopped) {
-            if(_start_preview_waiton_busy() != 0 ) {
-                ALOGE("restart preview failed");
-            }
-        }
-    }
+    ALOGD("stage preview size %d x %d", settings.resolution_h, settings.resolution_v);
+    _cam_service->stage_preview_size(settings.resolution_h, settings.resolution_v);
+    _staged_width = settings.resolution_h;
+    _staged_height = settings.resolution_v;
+    _reconfig_pending = true;
 }
 
 void CameraControl::_handle_video_start_streaming(int id)
@@ -362,6 +743,7 @@ void CameraControl::_handle_video_start_streaming(int id)
                 break;
             }
             ALOGD("preview is stopped before set id");
+            _send_progress(25);
             if (opened && _cam_service->close_camera() != 0) {
                 ALOGE("failed to close camera before change id");
                 break;
@@ -374,11 +756,13 @@ void CameraControl::_handle_video_start_streaming(int id)
             ALOGD("successfully set camera id to %d", id);
             _camera_id = id;
             success  = true;
+            _send_progress(50);
             if (opened && _open_camera_waiton_busy() != 0) {
                 ALOGE("failed to open camera after change id");
                 break;
             }
             ALOGD("camera is opened post set id");
+            _send_progress(75);
             if(_preview_width > 0 &&_cam_service->set_camera_preview_size(_preview_width, _preview_height) != 0) {
                 ALOGE("restore preview size failed %d x %d", _preview_width, _preview_height);
             }
@@ -393,7 +777,7 @@ void CameraControl::_handle_video_start_streaming(int id)
         success = true;
     }
 
-    _send_ack(MAV_CMD_VIDEO_START_STREAMING, success);
+    _send_command_ack(MAV_CMD_VIDEO_START_STREAMING, success);
     ALOGD("ack sent with result %d: START_STREAMING", success);
 }
 
@@ -402,7 +786,7 @@ void CameraControl::_handle_video_stop_streaming()
     bool success = false;
 
     success = (_stop_preview_waiton_busy() == 0);
-    _send_ack(MAV_CMD_VIDEO_STOP_STREAMING, success);
+    _send_command_ack(MAV_CMD_VIDEO_STOP_STREAMING, success);
     ALOGD("ack sent with result %d: STOP_STREAMING", success);
 }
 
@@ -411,7 +795,7 @@ void CameraControl::_handle_video_start_recording()
     bool success = false;
 
     success = (_start_video_recording_waiton_busy() == 0);
-    _send_ack(MAV_CMD_VIDEO_START_CAPTURE, success);
+    _send_command_ack(MAV_CMD_VIDEO_START_CAPTURE, success);
     ALOGD("ack sent with result %d: VIDEO_START_CAPTURE", success);
 }
 
@@ -420,44 +804,140 @@ void CameraControl::_handle_video_stop_recording()
     bool success = false;
 
     success = (_stop_video_recording_waiton_busy() == 0);
-    _send_ack(MAV_CMD_VIDEO_STOP_CAPTURE, success);
+    _send_command_ack(MAV_CMD_VIDEO_STOP_CAPTURE, success);
     ALOGD("ack sent with result %d: VIDEO_STOP_CAPTURE", success);
 }
 
-void CameraControl::_handle_capture_photo_image()
+// param2 is the interval in seconds, param3 the number of pictures. No
+// count takes one picture without an interval and runs until stopped with
+// one. A new sequence replaces a running one.
+void CameraControl::_handle_image_start_capture(mavlink_message_t* msg)
 {
-    bool success = false;
-    int result = 0;
+    mavlink_command_long_t cmd;
+    uint64_t now_ms = _get_monotonic_ms();
+    uint8_t result;
+    float interval;
+    float count;
+
+    mavlink_msg_command_long_decode(msg, &cmd);
+    if (_commands.find_result(*msg, now_ms, &result)) {
+        _send_ack_result(MAV_CMD_IMAGE_START_CAPTURE, result, 0, msg->sysid, msg->compid);
+        return;
+    }
+    // a NaN fails the comparisons too
+    if (!_is_camera_ready || !(cmd.param2 >= 0) || !(cmd.param3 >= 0)) {
+        ALOGE("image capture refused, interval %f count %f", cmd.param2, cmd.param3);
+        _ack_command(MAV_CMD_IMAGE_START_CAPTURE,
+                     _is_camera_ready ? MAV_RESULT_DENIED : MAV_RESULT_TEMPORARILY_REJECTED,
+                     msg->sysid, msg->compid);
+        return;
+    }
+    // clamped before the conversion, out of range it is undefined
+    interval = cmd.param2 > CAMERA_CAPTURE_MAX_INTERVAL_S ? CAMERA_CAPTURE_MAX_INTERVAL_S : cmd.param2;
+    count = cmd.param3 > CAMERA_CAPTURE_MAX_COUNT ? CAMERA_CAPTURE_MAX_COUNT : cmd.param3;
+    _capture_interval_ms = (uint32_t)(interval * 1000);
+    _capture_remaining = (int)count;
+    if (_capture_remaining == 0) {
+        _capture_remaining = _capture_interval_ms > 0 ? -1 : 1;
+    }
+    ALOGD("image capture of %d every %u ms", _capture_remaining, _capture_interval_ms);
+    _capture_next_ms = now_ms;
+    _ack_command(MAV_CMD_IMAGE_START_CAPTURE, MAV_RESULT_ACCEPTED, msg->sysid, msg->compid);
+    _schedule_captures(now_ms);
+}
 
-    _send_ack(MAV_CMD_IMAGE_START_CAPTURE, true);
-    ALOGD("ack sent : IMAGE_START_CAPTURE");
-    success = (_cam_service->capture_photo_image() == 0);
+// the pictures already taken still get their CAMERA_IMAGE_CAPTURED
+void CameraControl::_handle_image_stop_capture(mavlink_message_t* msg)
+{
+    _capture_remaining = 0;
+    _arm_capture_timer(0);
+    _ack_command(MAV_CMD_IMAGE_STOP_CAPTURE, MAV_RESULT_ACCEPTED, msg->sysid, msg->compid);
+}
 
-    if (success) {
-        result = 1;
-        g_image_index++;
+// Takes the pictures that are due, as long as fewer than
+// CAMERA_CAPTURES_IN_FLIGHT wait for their image. Called again when the
+// timer fires and when a capture finishes. A sequence that fell behind
+// goes on from now instead of catching up.
+void CameraControl::_schedule_captures(uint64_t now_ms)
+{
+    while (_capture_remaining != 0 && _capture_next_ms <= now_ms &&
+           _captures_in_flight < CAMERA_CAPTURES_IN_FLIGHT) {
+        if (_cam_service->start_capture() != 0) {
+            ALOGE("fail to start capture, image capture stopped");
+            _capture_remaining = 0;
+            break;
+        }
+        _captures_in_flight++;
+        if (_capture_remaining > 0) {
+            _capture_remaining--;
+        }
+        _capture_next_ms += _capture_interval_ms;
+        if (_capture_interval_ms > 0 && _capture_next_ms <= now_ms) {
+            _capture_next_ms = now_ms + _capture_interval_ms;
+        }
+    }
+    // a full pipeline waits for a capture to finish instead
+    if (_capture_remaining != 0 && _capture_next_ms > now_ms &&
+        _captures_in_flight < CAMERA_CAPTURES_IN_FLIGHT) {
+        _arm_capture_timer(_capture_next_ms);
+    } else {
+        _arm_capture_timer(0);
     }
+}
 
+// one shot at deadline_ms on the monotonic clock, 0 disarms
+void CameraControl::_arm_capture_timer(uint64_t deadline_ms)
+{
+    struct itimerspec ts = { };
+
+    if (_capture_timer_fd < 0) {
+        return;
+    }
+    ts.it_value.tv_sec = deadline_ms / 1000;
+    ts.it_value.tv_nsec = (deadline_ms % 1000) * 1000000;
+    if (timerfd_settime(_capture_timer_fd, TFD_TIMER_ABSTIME, &ts, NULL) < 0) {
+        ALOGE("fail to arm capture timer");
+    }
+}
+
+void CameraControl::_handle_capture_results(uint64_t now_ms)
+{
     mavlink_message_t msg;
-    mavlink_msg_camera_image_captured_pack(_system_id, _comp_id, &msg,
-            0/*time_boot_ms*/, 0/*time_utc*/, 1 /*camera_id, 1 for first, 2 for second*/,
-            0/*Latitude*/, 0/*Longitude*/, 0/*Altitude*/, 0/*Altitude above ground in meters*/,
-            NULL/*Quaternion of camera orientation*/, g_image_index/*image count since armed*/,
-            result/*capture_result, 1 success, 0 fail*/, NULL/*file_url URL of image taken*/);
-    _send_mavlink_msg(&msg);
-    ALOGD("sent msg: CAMERA_IMAGE_CAPTURED");
+    int result;
+    int rc;
+
+    while (_cam_service->take_capture_result(&rc)) {
+        if (_captures_in_flight > 0) {
+            _captures_in_flight--;
+        }
+        result = 0;
+        if (rc == 0) {
+            result = 1;
+            _image_index++;
+        } else {
+            ALOGE("capture failed %d", rc);
+        }
+        mavlink_msg_camera_image_captured_pack(_system_id, _comp_id, &msg,
+                0/*time_boot_ms*/, 0/*time_utc*/, 1 /*camera_id, 1 for first, 2 for second*/,
+                0/*Latitude*/, 0/*Longitude*/, 0/*Altitude*/, 0/*Altitude above ground in meters*/,
+                NULL/*Quaternion of camera orientation*/, _image_index/*image count since armed*/,
+                result/*capture_result, 1 success, 0 fail*/, NULL/*file_url URL of image taken*/);
+        _send_mavlink_msg(&msg);
+        ALOGD("sent msg: CAMERA_IMAGE_CAPTURED");
+    }
+    _schedule_captures(now_ms);
 }
 
 void CameraControl::_handle_request_capture_status()
 {
-    int state = -1;
+    camera_snapshot snapshot;
+    int state;
     int ps, vs;
-    _cam_service->get_camera_state(&state);
+    _get_snapshot(&snapshot);
+    state = snapshot.state;
     if (state == CAM_STATE_ZSL_PREVIEW || state == CAM_STATE_VIDEO_PREVIEW) {
-        ps = 0;
         vs = 0;
     } else if (state == CAM_STATE_VIDEO_RECORDING) {
-        ps = 0;
         vs = 1;
     } else {
         ALOGE("request camera capture status in wrong state %d", state);
@@ -466,6 +946,8 @@ void CameraControl::_handle_request_capture_status()
         return;
     }
 
+    ps = (_capture_remaining != 0 && _capture_interval_ms > 0 ? 2 : 0) +
+         (_captures_in_flight > 0 ? 1 : 0);
     ALOGD("camera capture status ps=%d vs=%d", ps, vs);
     _send_ack(MAV_CMD_REQUEST_CAMERA_CAPTURE_STATUS, true);
     ALOGD("ack sent: REQUEST_CAMERA_CAPTURE_STATUS");
@@ -475,16 +957,18 @@ void CameraControl::_handle_request_capture_status()
               0/*time_boot_ms*/,
               ps/*image_status (0: idle, 1: capture in progress, 2: interval set but idle, 3: interval set and capture in progress)*/,
               vs/*video_status (0: idle, 1: capture in progress)*/,
-              0/*image_interval*/, 0/*recording_time_ms*/, 0xffff/*available_capacity in MB*/);
+              _capture_interval_ms / 1000.f/*image_interval*/, 0/*recording_time_ms*/, 0xffff/*available_capacity in MB*/);
 
     _send_mavlink_msg(&msg);
 }
 
 void CameraControl::_handle_camera_settings_request()
 {
-    int state = -1;
+    camera_snapshot snapshot;
+    int state;
     int mode = -1;
-    _cam_service->get_camera_state(&state);
+    _get_snapshot(&snapshot);
+    state = snapshot.state;
     if (state == CAM_STATE_ZSL_PREVIEW) {
         mode = PINE_ZSL_MODE;
     } else if (state == CAM_STATE_VIDEO_PREVIEW) {
@@ -514,40 +998,17 @@ void CameraControl::_handle_storage_info_request()
 
 void CameraControl::_handle_set_camera_mode(int mode)
 {
-    bool success = false;
-    int state = -1;
-    int oldmode = -1;
-    bool previewing = false;
-    _cam_service->get_camera_state(&state);
-    if (state == CAM_STATE_ZSL_PREVIEW) {
-        oldmode = PINE_ZSL_MODE;
-        previewing = true;
-    } else if (state == CAM_STATE_VIDEO_PREVIEW) {
-        oldmode = PINE_VIDEO_MODE;
-        previewing = true;
-    } else if (state != CAM_STATE_OPEN) {
-        _send_ack(MAV_CMD_SET_CAMERA_MODE, false);
-        ALOGD("ack sent with failure: SET_CAMERA_MODE state wrong %d", state);
-        return;
+    ALOGD("stage camera mode %d", mode);
+    _cam_service->stage_camera_mode(mode);
+    // acked once the batch is applied, an earlier mode of the same batch
+    // is replaced by this one
+    if (_mode_ack_pending) {
+        _ack_command(MAV_CMD_SET_CAMERA_MODE, MAV_RESULT_ACCEPTED, _mode_ack_sys_id, _mode_ack_comp_id);
     }
-
-    if (previewing) {
-        ALOGD("need to stop preview at first");
-        if (_stop_preview_waiton_busy() != 0) {
-            _send_ack(MAV_CMD_SET_CAMERA_MODE, false);
-            ALOGD("ack sent with failure: SET_CAMERA_MODE can not stop preview");
-            return;
-        }
-    }
-    success = (_cam_service->set_camera_mode(mode) == 0);
-    ALOGD("set camera mode to %d success:%d", mode, success);
-    if (previewing) {
-        if(_start_preview_waiton_busy() != 0) {
-            ALOGE("restart preview failed");
-        }
-    }
-    _send_ack(MAV_CMD_SET_CAMERA_MODE, success);
-    ALOGD("ack sent with result %d: SET_CAMERA_MODE", success);
+    _mode_ack_pending = true;
+    _mode_ack_sys_id = _cmd_sys_id;
+    _mode_ack_comp_id = _cmd_comp_id;
+    _reconfig_pending = true;
 }
 
 int CameraControl::_open_camera_waiton_busy()
@@ -559,8 +1020,9 @@ int CameraControl::_open_camera_waiton_busy()
         if (r == 0) {
             break;
         } else if (r == -99) {
-            ALOGD("open camera busy");
-            usleep(100 * 1000);
+            if (!_wait_busy("open camera")) {
+                break;
+            }
             continue;
         }
     }
@@ -576,8 +1038,9 @@ int CameraControl::_start_preview_waiton_busy()
         if (r == 0) {
             break;
         } else if (r == -99) {
-            ALOGD("start preview busy");
-            usleep(100 * 1000);
+            if (!_wait_busy("start preview")) {
+                break;
+            }
             continue;
         }
     }
@@ -593,8 +1056,9 @@ int CameraControl::_stop_preview_waiton_busy()
         if (r == 0) {
             break;
         } else if (r == -99) {
-            ALOGD("start preview busy");
-            usleep(100 * 1000);
+            if (!_wait_busy("stop preview")) {
+                break;
+            }
             continue;
         }
     }
@@ -610,8 +1074,9 @@ int CameraControl::_start_video_recording_waiton_busy()
         if (r == 0) {
             break;
         } else if (r == -99) {
-            ALOGD("start preview busy");
-            usleep(100 * 1000);
+            if (!_wait_busy("start video recording")) {
+                break;
+            }
             continue;
         }
     }
@@ -627,8 +1092,9 @@ int CameraControl::_stop_video_recording_waiton_busy()
         if (r == 0) {
             break;
         } else if (r == -99) {
-            ALOGD("start preview busy");
-            usleep(100 * 1000);
+            if (!_wait_busy("stop video recording")) {
+                break;
+            }
             continue;
         }
     }
@@ -17,21 +17,70 @@
 #pragma once
 
 #include <sys/un.h>
+#include "camera_command_queue.h"
 #include "camera_service.h"
 #include "module_thread.h"
 
+class CameraControl;
+
+// what the read-only queries report
+struct camera_snapshot {
+    int state;
+    int preview_width;
+    int preview_height;
+    int32_t camera_id;
+};
+
+// runs the commands that change the camera, off the reactor thread
+class CameraCommandWorker : public ThreadBase {
+public:
+    CameraCommandWorker(CameraControl* control) : _control(control) { }
+    virtual void _thread_entry() override;
+
+private:
+    CameraControl* _control;
+};
+
 class CameraControl : public ModuleThread {
+    friend class CameraCommandWorker;
+
 public:
     CameraControl();
+    virtual bool start() override;
+    virtual void stop() override;
     void broadcast_heartbeat();
     bool camera_ready();
 
 protected:
-    static void _heartbeat_timeout(union sigval v);
-    bool _start_heartbeat();
+    void _poll_camera_open(uint64_t now_ms);
+    void _handle_image_start_capture(mavlink_message_t* msg);
+    void _handle_image_stop_capture(mavlink_message_t* msg);
+    void _schedule_captures(uint64_t now_ms);
+    void _arm_capture_timer(uint64_t deadline_ms);
+    void _handle_capture_results(uint64_t now_ms);
+    virtual bool _handle_timeout(int fd) override;
     virtual bool _process_data(int fd, uint8_t* buf, int len,
                                struct sockaddr* src_addr, int addrlen) override;
+    void _queue_command(mavlink_message_t* msg);
+    void _run_commands();
+    void _dispatch_command(mavlink_message_t* msg);
+    void _refresh_snapshot();
+    void _get_snapshot(camera_snapshot* snapshot);
+    bool _is_reconfigure_message(mavlink_message_t* msg);
+    void _commit_reconfigure();
     void _send_ack(int cmd, bool success);
+    void _send_ack_result(int cmd, uint8_t result, uint8_t progress,
+                          uint8_t target_sys_id, uint8_t target_comp_id);
+    void _send_command_ack(int cmd, bool success);
+    void _ack_command(int cmd, uint8_t result, uint8_t target_sys_id, uint8_t target_comp_id);
+    uint8_t _command_result(bool success);
+    void _begin_progress(int cmd, uint8_t target_sys_id, uint8_t target_comp_id);
+    void _send_progress(uint8_t progress);
+    void _refresh_progress();
+    bool _wait_busy(const char* what);
+#ifdef MAVLINK_MSG_ID_COMMAND_CANCEL
+    void _handle_command_cancel(mavlink_message_t* msg);
+#endif
     void _send_mavlink_msg(mavlink_message_t* pMsg);
     void _handle_camera_info_request();
     void _handle_camera_video_stream_request();
@@ -40,7 +89,6 @@ protected:
     void _handle_video_stop_streaming();
     void _handle_video_start_recording();
     void _handle_video_stop_recording();
-    void _handle_capture_photo_image();
     void _handle_request_capture_status();
     void _handle_camera_settings_request();
     void _handle_set_camera_mode(int mode);
@@ -58,11 +106,43 @@ private:
     uint8_t _src_comp_id;
     int _preview_width;
     int _preview_height;
+    // staged camera settings, committed once per batch of commands
+    bool _reconfig_pending;
+    int _staged_width;                  // -1 if no preview size is staged
+    int _staged_height;
+    bool _mode_ack_pending;
+    uint8_t _mode_ack_sys_id;
+    uint8_t _mode_ack_comp_id;
+    uint8_t _cmd_sys_id;                // sender of the command the worker runs
+    uint8_t _cmd_comp_id;
+    // slow command the worker reports IN_PROGRESS for, 0 if none
+    int _progress_cmd;
+    uint8_t _progress_sys_id;
+    uint8_t _progress_comp_id;
+    uint8_t _progress;
+    uint64_t _progress_ms;
+    CameraCommandWorker _worker;
+    CameraCommandQueue _commands;
+    pthread_mutex_t _snapshot_lock;
+    camera_snapshot _snapshot;
     bool _is_camera_ready;
+    bool _camera_opening;
+    uint32_t _open_retry_ms;            // grows while the open keeps failing
+    uint64_t _next_open_ms;
     uint32_t _uid;
     int32_t _camera_id;
     int32_t _camera_count;
     int _router_fd;
-    timer_t _timer_id;
+    int _heartbeat_timer_fd;
+    // photo sequence, run on the reactor while the pictures are taken on the
+    // camera thread
+    int _capture_timer_fd;
+    int _capture_fd;
+    uint32_t _capture_interval_ms;
+    int _capture_remaining;             // -1 until stopped, 0 if no sequence runs
+    uint64_t _capture_next_ms;
+    int _captures_in_flight;
+    int _image_index;
+    int _heartbeat_budget;
     CameraService* _cam_service;
 };
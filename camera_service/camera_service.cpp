@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -23,6 +24,7 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <string.h>
 
 #include <hardware/camera.h>
@@ -36,62 +38,288 @@ using namespace android;
 
 
 CameraService* CameraService::_instance = NULL;
+static pthread_mutex_t g_instance_lock = PTHREAD_MUTEX_INITIALIZER;
+// the camera control, d2d tracker and heartbeat threads all get here
 CameraService* CameraService::get_instance() {
+    pthread_mutex_lock(&g_instance_lock);
     if (_instance == NULL) {
         _instance = new CameraService();
     }
+    pthread_mutex_unlock(&g_instance_lock);
     return _instance;
 }
 
 CameraService::CameraService()
+    : _bitrate_pending(false)
+    , _bitrate(0)
+    , _idr_pending(false)
+    , _open_pending(false)
+    , _capture_fd(-1)
+    , _capture_seq(0)
+    , _params_valid(false)
+    , _params_version(0)
+    , _state(CAM_STATE_IDLE)
+    , _state_valid(false)
+    , _state_version(0)
+    , _state_ms(0)
+    , _mode(-1)
 {
+    bzero((void*)&_staged, sizeof(_staged));
+    pthread_mutex_init(&_lock_params, NULL);
+    pthread_mutex_init(&_lock_state, NULL);
+    pthread_mutex_init(&_lock_requests, NULL);
+    pthread_cond_init(&_cond_requests, NULL);
+    pthread_cond_init(&_cond_done, NULL);
+    pthread_mutex_init(&_lock_capture, NULL);
+    _capture_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (_capture_fd < 0) {
+        ALOGE("fail to create capture eventfd");
+    }
     if (SERVICE_NOT_READY == 0)
         return;
     _camera = new UAVCamera();
     _camera_cb= new CameraCallBack();
     _camera->setNotifyCallback(_camera_cb);
-    init_pthread_condition();
+    if (!start_thread()) {
+        ALOGE("fail to start camera thread");
+    }
+}
+
+void CameraService::_thread_entry()
+{
+    camera_request* request;
+    bool bitrate_pending;
+    int bitrate;
+    bool idr_pending;
+    int rc;
+
+    while (true) {
+        pthread_mutex_lock(&_lock_requests);
+        while (_requests.empty() && !_bitrate_pending && !_idr_pending) {
+            pthread_cond_wait(&_cond_requests, &_lock_requests);
+        }
+        request = NULL;
+        if (!_requests.empty()) {
+            request = _requests.front();
+            _requests.pop_front();
+        }
+        bitrate_pending = _bitrate_pending;
+        bitrate = _bitrate;
+        _bitrate_pending = false;
+        idr_pending = _idr_pending;
+        _idr_pending = false;
+        pthread_mutex_unlock(&_lock_requests);
+
+        // the encoder updates go first, they must not wait behind a slow command
+        if (bitrate_pending) {
+            rc = _camera->pineSetBitRate(bitrate);
+            if (rc != 0) {
+                ALOGE("set bitrate %d return %d", bitrate, rc);
+            }
+            ALOGV("bitrate %d sent", bitrate);
+        }
+        if (idr_pending) {
+            rc = _camera->pineRequestIdr();
+            if (rc != 0) {
+                ALOGE("request idr return %d", rc);
+            }
+        }
+        if (request != NULL && request->detached) {
+            _run_request(request);
+            // a picture the camera did not take has no image coming
+            if (request->type == CAMERA_REQUEST_TAKE_PICTURE && request->rc != 0) {
+                ALOGE("take picture return %d", request->rc);
+                _finish_capture(request->arg[0], request->rc);
+            }
+            delete request;
+        } else if (request != NULL) {
+            _run_request(request);
+            pthread_mutex_lock(&_lock_requests);
+            request->done = true;
+            pthread_cond_broadcast(&_cond_done);
+            pthread_mutex_unlock(&_lock_requests);
+        }
+    }
+}
+
+void CameraService::_run_request(camera_request* request)
+{
+    switch (request->type) {
+    case CAMERA_REQUEST_OPEN:
+        request->rc = _camera->openCamera();
+        break;
+    case CAMERA_REQUEST_CLOSE:
+        request->rc = _camera->closeCamera();
+        break;
+    case CAMERA_REQUEST_START_PREVIEW:
+        request->rc = _camera->startPreview();
+        break;
+    case CAMERA_REQUEST_STOP_PREVIEW:
+        request->rc = _camera->stopPreview();
+        break;
+    case CAMERA_REQUEST_START_RECORDING:
+        request->rc = _camera->startRecording();
+        break;
+    case CAMERA_REQUEST_STOP_RECORDING:
+        request->rc = _camera->stopRecording();
+        break;
+    case CAMERA_REQUEST_TAKE_PICTURE:
+        request->rc = _camera->takePicture();
+        break;
+    case CAMERA_REQUEST_GET_PARAMETERS:
+        request->params = _camera->getParameters();
+        request->rc = 0;
+        break;
+    case CAMERA_REQUEST_SET_PARAMETERS:
+        request->rc = _camera->setParameters(request->params);
+        break;
+    case CAMERA_REQUEST_GET_STATE:
+        _camera->pineGetCameraState(&request->arg[0]);
+        request->rc = 0;
+        break;
+    case CAMERA_REQUEST_GET_ID:
+        _camera->pineGetFPVCameraID(&request->arg[0], &request->arg[1]);
+        request->rc = 0;
+        break;
+    case CAMERA_REQUEST_SET_ID:
+        request->rc = _camera->pineSetFPVCameraID(request->arg[0]);
+        break;
+    default:
+        ALOGE("unknown camera request %d", request->type);
+        request->rc = -1;
+        break;
+    }
+}
+
+void CameraService::_submit(camera_request* request)
+{
+    request->rc = -1;
+    request->done = false;
+    request->detached = false;
+    pthread_mutex_lock(&_lock_requests);
+    _requests.push_back(request);
+    pthread_cond_signal(&_cond_requests);
+    pthread_mutex_unlock(&_lock_requests);
+}
+
+void CameraService::_submit_detached(camera_request* request)
+{
+    request->rc = -1;
+    request->done = false;
+    request->detached = true;
+    pthread_mutex_lock(&_lock_requests);
+    _requests.push_back(request);
+    pthread_cond_signal(&_cond_requests);
+    pthread_mutex_unlock(&_lock_requests);
+}
+
+int CameraService::_wait(camera_request* request)
+{
+    pthread_mutex_lock(&_lock_requests);
+    while (!request->done) {
+        pthread_cond_wait(&_cond_done, &_lock_requests);
+    }
+    pthread_mutex_unlock(&_lock_requests);
+    return request->rc;
+}
+
+int CameraService::_call(int type, int32_t arg)
+{
+    camera_request request;
+
+    request.type = type;
+    request.arg[0] = arg;
+    request.arg[1] = 0;
+    _submit(&request);
+    return _wait(&request);
 }
 
 int CameraService::open_camera() {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    return _camera->openCamera();
+    int rc;
+
+    _invalidate_params();
+    rc = _call(CAMERA_REQUEST_OPEN, 0);
+    _opened(rc);
+    return rc;
+}
+
+bool CameraService::open_camera_async() {
+    if (_camera == NULL) {
+        return false;
+    }
+    if (_open_pending) {
+        return true;
+    }
+    _invalidate_params();
+    _open_request.type = CAMERA_REQUEST_OPEN;
+    _open_pending = true;
+    _submit(&_open_request);
+    return true;
+}
+
+bool CameraService::open_camera_done(int* rc) {
+    bool done;
+
+    if (!_open_pending) {
+        return false;
+    }
+    pthread_mutex_lock(&_lock_requests);
+    done = _open_request.done;
+    pthread_mutex_unlock(&_lock_requests);
+    if (!done) {
+        return false;
+    }
+    _open_pending = false;
+    _opened(_open_request.rc);
+    *rc = _open_request.rc;
+    return true;
+}
+
+void CameraService::_opened(int rc) {
+    // the mode goes with the parameters
+    pthread_mutex_lock(&_lock_state);
+    _mode = -1;
+    pthread_mutex_unlock(&_lock_state);
+    _set_state_after(rc, CAM_STATE_OPEN);
 }
 
 int CameraService::close_camera() {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    return _camera->closeCamera();
+    int rc;
+
+    _invalidate_params();
+    rc = _call(CAMERA_REQUEST_CLOSE, 0);
+    // the mode goes with the parameters
+    pthread_mutex_lock(&_lock_state);
+    _mode = -1;
+    pthread_mutex_unlock(&_lock_state);
+    _set_state_after(rc, CAM_STATE_IDLE);
+    return rc;
 }
 
 int CameraService::set_camera_preview_size(unsigned int width, unsigned int height) {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    String8 params;
-    CameraParameters cam_param;
-
-    params = _camera->getParameters();
-    cam_param.unflatten(params);
-    cam_param.setPreviewSize(width, height);
-    params = cam_param.flatten();
-
-    return _camera->setParameters(params);
+    stage_preview_size(width, height);
+    return commit_reconfigure();
 }
 
 int CameraService::get_camera_preview_size(int* width, int* height) {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    String8 params;
-    CameraParameters cam_param;
+    CameraParameters params;
 
-    params = _camera->getParameters();
-    cam_param.unflatten(params);
-    cam_param.getPreviewSize(width, height);
+    if (!_get_params(&params)) {
+        return -1;
+    }
+    params.getPreviewSize(width, height);
     return 0;
 }
 
@@ -99,84 +327,355 @@ int CameraService::start_preview() {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    return _camera->startPreview();
+    int rc = _call(CAMERA_REQUEST_START_PREVIEW, 0);
+
+    pthread_mutex_lock(&_lock_state);
+    if (rc == 0 && _mode >= 0) {
+        _state = (_mode == 1) ? CAM_STATE_VIDEO_PREVIEW : CAM_STATE_ZSL_PREVIEW;
+        _state_valid = true;
+    } else {
+        // which preview depends on a mode we have not seen
+        _state_valid = false;
+    }
+    _state_version++;
+    pthread_mutex_unlock(&_lock_state);
+    return rc;
 }
 
 int CameraService::stop_preview() {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    return _camera->stopPreview();
+    int rc = _call(CAMERA_REQUEST_STOP_PREVIEW, 0);
+
+    _set_state_after(rc, CAM_STATE_OPEN);
+    return rc;
 }
 
 int CameraService::start_video_recording() {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    return _camera->startRecording();
+    int rc = _call(CAMERA_REQUEST_START_RECORDING, 0);
+
+    _set_state_after(rc, CAM_STATE_VIDEO_RECORDING);
+    return rc;
 }
 
 int CameraService::stop_video_recording() {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    return _camera->stopRecording();
+    int rc = _call(CAMERA_REQUEST_STOP_RECORDING, 0);
+
+    _set_state_after(rc, CAM_STATE_VIDEO_PREVIEW);
+    return rc;
 }
 
-int CameraService::capture_photo_image() {
-    int rc;
+int CameraService::start_capture() {
+    if (_camera == NULL || _capture_fd < 0) {
+        return SERVICE_NOT_READY;
+    }
+    camera_request* request = new camera_request;
+    camera_capture capture;
+
+    // queued before the picture is taken, its image may come back at once
+    pthread_mutex_lock(&_lock_capture);
+    capture.seq = _capture_seq++;
+    capture.start_ms = _get_monotonic_ms();
+    _captures.push_back(capture);
+    pthread_mutex_unlock(&_lock_capture);
+    request->type = CAMERA_REQUEST_TAKE_PICTURE;
+    request->arg[0] = capture.seq;
+    request->arg[1] = 0;
+    _submit_detached(request);
+    return 0;
+}
+
+bool CameraService::take_capture_result(int* rc) {
+    bool found;
+
+    pthread_mutex_lock(&_lock_capture);
+    found = !_capture_results.empty();
+    if (found) {
+        *rc = _capture_results.front();
+        _capture_results.pop_front();
+    }
+    pthread_mutex_unlock(&_lock_capture);
+    return found;
+}
+
+void CameraService::expire_captures(uint64_t now_ms) {
+    uint64_t count = 0;
+
+    pthread_mutex_lock(&_lock_capture);
+    while (!_captures.empty() && now_ms - _captures.front().start_ms >= CAMERA_CAPTURE_TIMEOUT_MS) {
+        ALOGE("capture %u got no image", _captures.front().seq);
+        _expired.push_back(_captures.front());
+        _expired.back().start_ms = now_ms;
+        _captures.pop_front();
+        _capture_results.push_back(-ETIMEDOUT);
+        count++;
+    }
+    _forget_expired(now_ms);
+    pthread_mutex_unlock(&_lock_capture);
+    if (count > 0 && write(_capture_fd, &count, sizeof(count)) != sizeof(count)) {
+        ALOGE("fail to signal capture eventfd");
+    }
+}
+
+int CameraService::get_capture_fd() {
+    return _capture_fd;
+}
+
+// Images come in the order the pictures were taken. A late image of an
+// expired capture would be credited to the next one and put every later
+// capture off by one, so it is dropped.
+void CameraService::_image_taken() {
+    bool found;
+    uint32_t seq = 0;
+
+    pthread_mutex_lock(&_lock_capture);
+    _forget_expired(_get_monotonic_ms());
+    if (!_expired.empty()) {
+        _expired.pop_front();
+        pthread_mutex_unlock(&_lock_capture);
+        ALOGW("late image of an expired capture, dropped");
+        return;
+    }
+    found = !_captures.empty();
+    if (found) {
+        seq = _captures.front().seq;
+    }
+    pthread_mutex_unlock(&_lock_capture);
+    if (!found) {
+        ALOGW("image without a capture waiting for it");
+        return;
+    }
+    _finish_capture(seq, 0);
+}
+
+// an expired capture whose image did not come within another timeout
+// never gets one, it must not swallow the image of a later capture
+void CameraService::_forget_expired(uint64_t now_ms) {
+    while (!_expired.empty() && _expired.front().start_ms + CAMERA_CAPTURE_TIMEOUT_MS <= now_ms) {
+        _expired.pop_front();
+    }
+}
+
+void CameraService::_finish_capture(uint32_t seq, int rc) {
+    std::deque<camera_capture>::iterator it;
+    uint64_t one = 1;
+    bool found = false;
+
+    pthread_mutex_lock(&_lock_capture);
+    for (it = _captures.begin(); it != _captures.end(); ++it) {
+        if (it->seq == seq) {
+            _captures.erase(it);
+            _capture_results.push_back(rc);
+            found = true;
+            break;
+        }
+    }
+    // a failed picture has no image coming, not even a late one
+    for (it = _expired.begin(); !found && it != _expired.end(); ++it) {
+        if (it->seq == seq) {
+            _expired.erase(it);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_lock_capture);
+    // an expired capture was reported already
+    if (found && write(_capture_fd, &one, sizeof(one)) != sizeof(one)) {
+        ALOGE("fail to signal capture eventfd");
+    }
+}
+
+int CameraService::set_camera_mode(unsigned int mode) {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    rc = _camera->takePicture();
-    if (rc != 0) {
-        return rc;
+    stage_camera_mode(mode);
+    return commit_reconfigure();
+}
+
+void CameraService::stage_preview_size(unsigned int width, unsigned int height) {
+    pthread_mutex_lock(&_lock_params);
+    _staged.preview_size = true;
+    _staged.width = width;
+    _staged.height = height;
+    pthread_mutex_unlock(&_lock_params);
+}
+
+void CameraService::stage_camera_mode(unsigned int mode) {
+    pthread_mutex_lock(&_lock_params);
+    _staged.mode = true;
+    _staged.recording_hint = (mode == 1);
+    pthread_mutex_unlock(&_lock_params);
+}
+
+bool CameraService::has_staged_changes() {
+    bool staged;
+
+    pthread_mutex_lock(&_lock_params);
+    staged = _staged.preview_size || _staged.mode;
+    pthread_mutex_unlock(&_lock_params);
+    return staged;
+}
+
+// Drops the staged values the camera already has. Whatever is left
+// changes the stream, which the camera only takes with the preview off.
+int CameraService::prepare_reconfigure(bool* changed) {
+    if (_camera == NULL) {
+        return SERVICE_NOT_READY;
     }
-    rc = cond_wait_photo_capture();
-    if (rc == 0) {
-        return 0;
-    } else {
+    CameraParameters params;
+    int width;
+    int height;
+    const char* hint;
+
+    if (!_get_params(&params)) {
         return -1;
     }
+    pthread_mutex_lock(&_lock_params);
+    if (_staged.preview_size) {
+        params.getPreviewSize(&width, &height);
+        if (width == (int)_staged.width && height == (int)_staged.height) {
+            _staged.preview_size = false;
+        }
+    }
+    if (_staged.mode) {
+        hint = params.get(CameraParameters::KEY_RECORDING_HINT);
+        if (hint != NULL && !strcmp(hint, _staged.recording_hint ? "true" : "false")) {
+            _staged.mode = false;
+        }
+    }
+    *changed = _staged.preview_size || _staged.mode;
+    pthread_mutex_unlock(&_lock_params);
+    return 0;
 }
 
-int CameraService::set_camera_mode(unsigned int mode) {
+// applies every staged change with a single setParameters
+int CameraService::commit_reconfigure() {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    String8 params;
-    CameraParameters cam_param;
+    CameraParameters params;
+    camera_reconfig staged;
+    camera_request request;
+    int rc;
 
-    params = _camera->getParameters();
-    cam_param.unflatten(params);
-    if (mode == 1)
-        cam_param.set(CameraParameters::KEY_RECORDING_HINT, "true");
-    else
-        cam_param.set(CameraParameters::KEY_RECORDING_HINT, "false");
-    params = cam_param.flatten();
+    pthread_mutex_lock(&_lock_params);
+    staged = _staged;
+    bzero((void*)&_staged, sizeof(_staged));
+    pthread_mutex_unlock(&_lock_params);
+    if (!staged.preview_size && !staged.mode) {
+        return 0;
+    }
+    if (!_get_params(&params)) {
+        return -1;
+    }
+    if (staged.preview_size) {
+        params.setPreviewSize(staged.width, staged.height);
+    }
+    if (staged.mode) {
+        params.set(CameraParameters::KEY_RECORDING_HINT,
+                   staged.recording_hint ? "true" : "false");
+    }
+    request.type = CAMERA_REQUEST_SET_PARAMETERS;
+    request.params = params.flatten();
+    _submit(&request);
+    rc = _wait(&request);
+    // the camera may adjust what it was given, read it back on next use
+    _invalidate_params();
+    if (staged.mode) {
+        pthread_mutex_lock(&_lock_state);
+        if (rc != 0) {
+            _mode = -1;
+        } else {
+            _mode = staged.recording_hint ? 1 : 0;
+        }
+        pthread_mutex_unlock(&_lock_state);
+    }
+    return rc;
+}
 
-    return _camera->setParameters(params);
+void CameraService::discard_reconfigure() {
+    pthread_mutex_lock(&_lock_params);
+    bzero((void*)&_staged, sizeof(_staged));
+    pthread_mutex_unlock(&_lock_params);
 }
 
 int CameraService::set_bitrate(int snr) {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    return _camera->pineSetBitRate(snr);
+    pthread_mutex_lock(&_lock_requests);
+    _bitrate = snr;
+    _bitrate_pending = true;
+    pthread_cond_signal(&_cond_requests);
+    pthread_mutex_unlock(&_lock_requests);
+    return 0;
 }
 
+// IDRs asked for before the camera thread gets to them make a single one
 int CameraService::request_idr() {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    return _camera->pineRequestIdr();
+    pthread_mutex_lock(&_lock_requests);
+    _idr_pending = true;
+    pthread_cond_signal(&_cond_requests);
+    pthread_mutex_unlock(&_lock_requests);
+    return 0;
 }
 
 int CameraService::get_camera_state(int* pState) {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    _camera->pineGetCameraState(pState);
+    uint64_t now = _get_monotonic_ms();
+    camera_request request;
+    uint32_t version;
+    int32_t state = -1;
+
+    pthread_mutex_lock(&_lock_state);
+    if (_state_valid && now - _state_ms < CAMERA_STATE_RECONCILE_MS) {
+        *pState = _state;
+        pthread_mutex_unlock(&_lock_state);
+        return 0;
+    }
+    version = _state_version;
+    pthread_mutex_unlock(&_lock_state);
+
+    // asked without the lock, the callbacks and the reactor do not wait
+    // behind the camera thread
+    request.type = CAMERA_REQUEST_GET_STATE;
+    request.arg[0] = -1;
+    _submit(&request);
+    _wait(&request);
+    state = request.arg[0];
+
+    pthread_mutex_lock(&_lock_state);
+    // a state set meanwhile is newer than the answer
+    if (version == _state_version) {
+        if (_state_valid && state != _state) {
+            ALOGW("camera state mirror was %d, camera is %d", _state, state);
+        }
+        _state = state;
+        _state_valid = true;
+        _state_ms = now;
+        _state_version++;
+        if (state == CAM_STATE_ZSL_PREVIEW) {
+            _mode = 0;
+        } else if (state == CAM_STATE_VIDEO_PREVIEW || state == CAM_STATE_VIDEO_RECORDING) {
+            _mode = 1;
+        }
+    } else if (_state_valid) {
+        state = _state;
+    }
+    *pState = state;
+    pthread_mutex_unlock(&_lock_state);
     return 0;
 }
 
@@ -184,7 +683,15 @@ int CameraService::get_camera_id(int* pId, int* pCount) {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    _camera->pineGetFPVCameraID(pId, pCount);
+    camera_request request;
+
+    request.type = CAMERA_REQUEST_GET_ID;
+    request.arg[0] = 0;
+    request.arg[1] = 0;
+    _submit(&request);
+    _wait(&request);
+    *pId = request.arg[0];
+    *pCount = request.arg[1];
     return 0;
 }
 
@@ -192,7 +699,72 @@ int CameraService::set_camera_id(int id) {
     if (_camera == NULL) {
         return SERVICE_NOT_READY;
     }
-    return _camera->pineSetFPVCameraID(id);
+    // another camera comes with its own parameters
+    _invalidate_params();
+    return _call(CAMERA_REQUEST_SET_ID, id);
+}
+
+// A copy of the cached parameters, read from the camera without the lock
+// if they are out of date. They are only cached if nothing invalidated
+// them during the round trip.
+bool CameraService::_get_params(CameraParameters* params) {
+    camera_request request;
+    uint32_t version;
+
+    pthread_mutex_lock(&_lock_params);
+    if (_params_valid) {
+        *params = _params;
+        pthread_mutex_unlock(&_lock_params);
+        return true;
+    }
+    version = _params_version;
+    pthread_mutex_unlock(&_lock_params);
+    request.type = CAMERA_REQUEST_GET_PARAMETERS;
+    _submit(&request);
+    _wait(&request);
+    if (request.params.isEmpty()) {
+        ALOGE("camera returned no parameters");
+        return false;
+    }
+    params->unflatten(request.params);
+    pthread_mutex_lock(&_lock_params);
+    if (version == _params_version) {
+        _params = *params;
+        _params_valid = true;
+    }
+    pthread_mutex_unlock(&_lock_params);
+    return true;
+}
+
+void CameraService::_set_state(int state) {
+    pthread_mutex_lock(&_lock_state);
+    _state = state;
+    _state_valid = true;
+    _state_version++;
+    pthread_mutex_unlock(&_lock_state);
+}
+
+// a failed call leaves the camera in a state we can not tell, ask it next time
+void CameraService::_set_state_after(int rc, int state) {
+    if (rc == 0) {
+        _set_state(state);
+    } else {
+        _invalidate_state();
+    }
+}
+
+void CameraService::_invalidate_state() {
+    pthread_mutex_lock(&_lock_state);
+    _state_valid = false;
+    _state_version++;
+    pthread_mutex_unlock(&_lock_state);
+}
+
+void CameraService::_invalidate_params() {
+    pthread_mutex_lock(&_lock_params);
+    _params_valid = false;
+    _params_version++;
+    pthread_mutex_unlock(&_lock_params);
 }
 
 void CameraService::camera_notify_callback(int32_t msgType, int32_t ext1, int32_t ext2)
@@ -200,14 +772,25 @@ void CameraService::camera_notify_callback(int32_t msgType, int32_t ext1, int32_
     (void) ext1;
     (void) ext2;
 
+    // only the notifies that change the parameters or the state drop the
+    // cached copies, pictures leave both as they are
     switch(msgType) {
         case CAMERA_MSG_COMPRESSED_IMAGE:
-            get_instance()->cond_signal_photo_capture();
+            get_instance()->_image_taken();
             break;
         case CAMERA_MSG_SHUTTER:
             break;
         case CAMERA_MSG_RAW_IMAGE_NOTIFY:
             break;
+        case CAMERA_MSG_ZOOM:
+            // a smooth zoom step moves the zoom parameter
+            get_instance()->_invalidate_params();
+            break;
+        case CAMERA_MSG_ERROR:
+            // the camera may have dropped back to idle and reset itself
+            get_instance()->_invalidate_params();
+            get_instance()->_invalidate_state();
+            break;
         default:
             break;
     }
@@ -220,35 +803,3 @@ void CameraService::camera_data_callback(int64_t timestamp, int32_t width, int32
     (void) height;
     (void) buf;
 }
-
-void CameraService::init_pthread_condition()
-{
-    pthread_condattr_t cond_attr;
-
-    pthread_condattr_init(&cond_attr);
-    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
-    pthread_cond_init(&_cond_photo_capture, &cond_attr);
-}
-
-void CameraService::cond_signal_photo_capture()
-{
-    pthread_mutex_lock(&_lock_photo_capture);
-    pthread_cond_signal(&_cond_photo_capture);
-    pthread_mutex_unlock(&_lock_photo_capture);
-}
-
-int CameraService::cond_wait_photo_capture()
-{
-    int rc;
-    timespec ts;
-
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    ts.tv_sec += 5;
-    pthread_mutex_lock(&_lock_photo_capture);
-    rc = pthread_cond_timedwait(&_cond_photo_capture, &_lock_photo_capture, &ts);
-    pthread_mutex_unlock(&_lock_photo_capture);
-    if (rc != 0) {
-        ALOGE("take photo timedwait return %d", rc);
-    }
-    return rc;
-}
@@ -16,15 +16,73 @@
 
 #pragma once
 
+#include <deque>
 #include "UAVCamera.h"
 #include "camera_callback.h"
+#include "thread_base.h"
 
 using namespace android;
 
-class CameraService {
+#define CAMERA_STATE_RECONCILE_MS 5000
+#define CAMERA_CAPTURE_TIMEOUT_MS 5000      // a picture without its image has failed
+
+// calls the camera thread makes on behalf of the others
+enum {
+    CAMERA_REQUEST_OPEN = 0,
+    CAMERA_REQUEST_CLOSE,
+    CAMERA_REQUEST_START_PREVIEW,
+    CAMERA_REQUEST_STOP_PREVIEW,
+    CAMERA_REQUEST_START_RECORDING,
+    CAMERA_REQUEST_STOP_RECORDING,
+    CAMERA_REQUEST_TAKE_PICTURE,
+    CAMERA_REQUEST_GET_PARAMETERS,
+    CAMERA_REQUEST_SET_PARAMETERS,
+    CAMERA_REQUEST_GET_STATE,
+    CAMERA_REQUEST_GET_ID,
+    CAMERA_REQUEST_SET_ID,
+};
+
+// lives with the caller until done is set, rc and the outputs are valid then;
+// a detached one is not waited for and freed by the camera thread
+struct camera_request {
+    int type;
+    int32_t arg[2];                 // input, or output of the get requests
+    String8 params;                 // parameters to set, or the ones read
+    int rc;
+    bool done;
+    bool detached;
+};
+
+// a picture taken, waiting for its compressed image
+struct camera_capture {
+    uint32_t seq;
+    uint64_t start_ms;
+};
+
+// parameter changes collected for one setParameters
+struct camera_reconfig {
+    bool preview_size;
+    unsigned int width;
+    unsigned int height;
+    bool mode;
+    bool recording_hint;
+};
+
+/*
+ * Only the camera thread talks to the camera. Other threads queue a
+ * request and wait for its completion, so the binder calls never overlap.
+ * Bitrate and IDR updates are not waited for: only the latest bitrate is
+ * kept until the camera thread gets to it, so a burst of link updates
+ * costs one binder call.
+ */
+class CameraService : public ThreadBase {
 public:
     static CameraService* get_instance();
     int open_camera();
+    // starts an open without waiting for it, open_camera_done returns true
+    // and the result once it finished; one caller thread only
+    bool open_camera_async();
+    bool open_camera_done(int* rc);
     int close_camera();
     int set_camera_preview_size(unsigned int width, unsigned int height);
     int get_camera_preview_size(int* width, int* height);
@@ -32,8 +90,23 @@ public:
     int stop_preview();
     int start_video_recording();
     int stop_video_recording();
-    int capture_photo_image();
+    // takes a picture without waiting for it, the result of each one is
+    // queued once its image came and the capture fd gets readable
+    int start_capture();
+    bool take_capture_result(int* rc);
+    // fails the captures whose image is overdue
+    void expire_captures(uint64_t now_ms);
+    int get_capture_fd();
     int set_camera_mode(unsigned int mode);
+    // reconfiguration transaction: stage changes, check whether they need
+    // the preview restarted, then apply them together
+    void stage_preview_size(unsigned int width, unsigned int height);
+    void stage_camera_mode(unsigned int mode);
+    bool has_staged_changes();
+    int prepare_reconfigure(bool* changed);
+    int commit_reconfigure();
+    void discard_reconfigure();
+    // queued, a newer bitrate replaces one not sent yet
     int set_bitrate(int snr);
     int request_idr();
     int get_camera_state(int* state);
@@ -42,16 +115,59 @@ public:
     static void camera_notify_callback(int32_t msgType, int32_t ext1, int32_t ext2);
     static void camera_data_callback(int64_t timestamp, int32_t width, int32_t height,
                                      unsigned char *buf);
-    void init_pthread_condition();
-    void cond_signal_photo_capture();
-    int cond_wait_photo_capture();
+    virtual void _thread_entry() override;
 
 private:
     CameraService();
+    int _call(int type, int32_t arg);
+    void _submit(camera_request* request);
+    void _submit_detached(camera_request* request);
+    int _wait(camera_request* request);
+    void _run_request(camera_request* request);
+    void _opened(int rc);
+    void _image_taken();
+    void _finish_capture(uint32_t seq, int rc);
+    void _forget_expired(uint64_t now_ms);
+    bool _get_params(CameraParameters* params);
+    void _invalidate_params();
+    void _set_state(int state);
+    void _set_state_after(int rc, int state);
+    void _invalidate_state();
 
     static CameraService* _instance;
-    sp<UAVCamera> _camera;
+    sp<UAVCamera> _camera;          // used by the camera thread only
+    pthread_mutex_t _lock_requests;
+    pthread_cond_t _cond_requests;  // wakes the camera thread
+    pthread_cond_t _cond_done;      // wakes the callers
+    std::deque<camera_request*> _requests;
+    bool _bitrate_pending;
+    int _bitrate;
+    bool _idr_pending;
+    camera_request _open_request;
+    bool _open_pending;             // _open_request is queued or running
     sp<CameraCallBack> _camera_cb;
-    pthread_mutex_t _lock_photo_capture;
-    pthread_cond_t _cond_photo_capture;
+    // eventfd counting finished captures
+    int _capture_fd;
+    pthread_mutex_t _lock_capture;
+    uint32_t _capture_seq;
+    std::deque<camera_capture> _captures;
+    // expired captures, their image may still come and is dropped;
+    // start_ms is the time they expired
+    std::deque<camera_capture> _expired;
+    std::deque<int> _capture_results;
+    // parsed copy of the camera parameters, reloaded after a set or a notify
+    // that changes them. The locks are never held across a camera request.
+    pthread_mutex_t _lock_params;
+    CameraParameters _params;
+    bool _params_valid;
+    uint32_t _params_version;       // bumped on every invalidation
+    camera_reconfig _staged;
+    // mirror of the camera state, kept from our own calls and checked
+    // against the camera every CAMERA_STATE_RECONCILE_MS
+    pthread_mutex_t _lock_state;
+    int _state;
+    bool _state_valid;
+    uint32_t _state_version;        // bumped on every change
+    uint64_t _state_ms;             // last time the camera was asked
+    int _mode;                      // from the last set_camera_mode, -1 if unknown
 };
@@ -23,7 +23,7 @@
 
 #undef LOG_TAG
 #define LOG_TAG "Config"
-#define MAX_LINES 32
+#define MAX_LINES 64
 #define MAX_LINE_TEXT 128
 
 #define NULL_STRING                     ((char*)"")
@@ -41,6 +41,27 @@
 #define DEFAULT_ROUTER_CONTROLLER_NAME  ((char*)"routercontroller")
 #define DEFAULT_CPU_TEMPERATURE_HIGH_V  95000 //(95 degrees Celsius)
 #define DEFAULT_BATTERY_LEVEL_LOW_V     20
+#define DEFAULT_CPU_TEMPERATURE_HYST    0
+#define DEFAULT_BATTERY_LEVEL_HYST      0
+#define DEFAULT_LAMP_KEEPALIVE_INTERVAL 10000  // ms, 0 disables resending
+#define DEFAULT_BITRATE_CONTROLLER      ((char*)"legacy")  // legacy, aimd or smoothed
+#define DEFAULT_BITRATE_MIN             500  // kbps
+#define DEFAULT_BITRATE_MAX             20000  // kbps
+#define DEFAULT_BITRATE_HYSTERESIS      10  // percent
+#define DEFAULT_BITRATE_MIN_INTERVAL    1000  // ms between increases
+#define DEFAULT_BITRATE_IDR_INTERVAL    1000  // ms between idr requests
+#define DEFAULT_BITRATE_RAMP_HOLDOFF    3000  // ms without increase after a decrease
+#define DEFAULT_LINK_PREDICTOR_ENABLED  false  // predictions are only scored when off
+#define DEFAULT_LINK_PREDICTOR_HORIZON  2000  // ms
+#define DEFAULT_LINK_PREDICTOR_CUT      70  // percent of the bitrate kept
+#define DEFAULT_D2D_COMBINE_RULE        ((char*)"best")  // best, worst or weighted
+#define DEFAULT_D2D_SOURCE_TIMEOUT      5000  // ms without update before a source is dropped
+#define DEFAULT_RADIO_STATUS_INTERVAL   500  // ms
+#define DEFAULT_RC_LINK_INTERVAL        100  // ms, 0 sends every update
+#define DEFAULT_BOARD_TELEMETRY_INTERVAL 500  // ms
+#define DEFAULT_TELEMETRY_BUDGET_FRACTION 5  // percent of ul_bandwidth
+#define DEFAULT_TIME_SYNC_CLIENT_RATE   4   // requests per second per client
+#define DEFAULT_TIME_SYNC_SERVER_ID     0   // 0 takes the first server that answers
 #define DEFAULT_BOARD_CONTROL_ENABLED   false
 #define DEFAULT_CAMERA_CONTROL_ENABLED  false
 #define DEFAULT_WIFI_CONTROL_ENABLED    false
@@ -65,6 +86,27 @@ Config::Config()
 	, _router_controller_name(DEFAULT_ROUTER_CONTROLLER_NAME)
 	, _cpu_temperature_high_value(DEFAULT_CPU_TEMPERATURE_HIGH_V)
 	, _battery_level_low_value(DEFAULT_BATTERY_LEVEL_LOW_V)
+	, _cpu_temperature_hysteresis(DEFAULT_CPU_TEMPERATURE_HYST)
+	, _battery_level_hysteresis(DEFAULT_BATTERY_LEVEL_HYST)
+	, _lamp_keepalive_interval(DEFAULT_LAMP_KEEPALIVE_INTERVAL)
+	, _bitrate_controller(DEFAULT_BITRATE_CONTROLLER)
+	, _bitrate_min(DEFAULT_BITRATE_MIN)
+	, _bitrate_max(DEFAULT_BITRATE_MAX)
+	, _bitrate_hysteresis(DEFAULT_BITRATE_HYSTERESIS)
+	, _bitrate_min_interval(DEFAULT_BITRATE_MIN_INTERVAL)
+	, _bitrate_idr_min_interval(DEFAULT_BITRATE_IDR_INTERVAL)
+	, _bitrate_ramp_holdoff(DEFAULT_BITRATE_RAMP_HOLDOFF)
+	, _link_predictor_enabled(DEFAULT_LINK_PREDICTOR_ENABLED)
+	, _link_predictor_horizon(DEFAULT_LINK_PREDICTOR_HORIZON)
+	, _link_predictor_cut(DEFAULT_LINK_PREDICTOR_CUT)
+	, _d2d_combine_rule(DEFAULT_D2D_COMBINE_RULE)
+	, _d2d_source_timeout(DEFAULT_D2D_SOURCE_TIMEOUT)
+	, _radio_status_interval(DEFAULT_RADIO_STATUS_INTERVAL)
+	, _rc_link_interval(DEFAULT_RC_LINK_INTERVAL)
+	, _board_telemetry_interval(DEFAULT_BOARD_TELEMETRY_INTERVAL)
+	, _telemetry_budget_fraction(DEFAULT_TELEMETRY_BUDGET_FRACTION)
+	, _time_sync_client_rate(DEFAULT_TIME_SYNC_CLIENT_RATE)
+	, _time_sync_server_id(DEFAULT_TIME_SYNC_SERVER_ID)
 	, _board_control_enabled(DEFAULT_BOARD_CONTROL_ENABLED)
 	, _camera_control_enabled(DEFAULT_CAMERA_CONTROL_ENABLED)
 	, _wifi_control_enabled(DEFAULT_WIFI_CONTROL_ENABLED)
@@ -156,6 +198,111 @@ int Config::get_battery_level_low_value()
     return _battery_level_low_value;
 }
 
+int Config::get_cpu_temperature_hysteresis()
+{
+    return _cpu_temperature_hysteresis;
+}
+
+int Config::get_battery_level_hysteresis()
+{
+    return _battery_level_hysteresis;
+}
+
+int Config::get_lamp_keepalive_interval()
+{
+    return _lamp_keepalive_interval;
+}
+
+char* Config::get_bitrate_controller()
+{
+    return _bitrate_controller;
+}
+
+int Config::get_bitrate_min()
+{
+    return _bitrate_min;
+}
+
+int Config::get_bitrate_max()
+{
+    return _bitrate_max;
+}
+
+int Config::get_bitrate_hysteresis()
+{
+    return _bitrate_hysteresis;
+}
+
+int Config::get_bitrate_min_interval()
+{
+    return _bitrate_min_interval;
+}
+
+int Config::get_bitrate_idr_min_interval()
+{
+    return _bitrate_idr_min_interval;
+}
+
+int Config::get_bitrate_ramp_holdoff()
+{
+    return _bitrate_ramp_holdoff;
+}
+
+bool Config::get_link_predictor_enabled()
+{
+    return _link_predictor_enabled;
+}
+
+int Config::get_link_predictor_horizon()
+{
+    return _link_predictor_horizon;
+}
+
+int Config::get_link_predictor_cut()
+{
+    return _link_predictor_cut;
+}
+
+char* Config::get_d2d_combine_rule()
+{
+    return _d2d_combine_rule;
+}
+
+int Config::get_d2d_source_timeout()
+{
+    return _d2d_source_timeout;
+}
+
+int Config::get_radio_status_interval()
+{
+    return _radio_status_interval;
+}
+
+int Config::get_rc_link_interval()
+{
+    return _rc_link_interval;
+}
+
+int Config::get_board_telemetry_interval()
+{
+    return _board_telemetry_interval;
+}
+
+int Config::get_telemetry_budget_fraction()
+{
+    return _telemetry_budget_fraction;
+}
+
+int Config::get_time_sync_client_rate()
+{
+    return _time_sync_client_rate;
+}
+
+int Config::get_time_sync_server_id()
+{
+    return _time_sync_server_id;
+}
+
 bool Config::get_board_control_enabled()
 {
     return _board_control_enabled;
@@ -237,6 +384,48 @@ void Config::load_config(const char* filename)
             get_int_value(&_cpu_temperature_high_value, delimiters);
         } else if (strcmp(string, "battery_level_low_value") == 0) {
             get_int_value(&_battery_level_low_value, delimiters);
+        } else if (strcmp(string, "cpu_temperature_hysteresis") == 0) {
+            get_int_value(&_cpu_temperature_hysteresis, delimiters);
+        } else if (strcmp(string, "battery_level_hysteresis") == 0) {
+            get_int_value(&_battery_level_hysteresis, delimiters);
+        } else if (strcmp(string, "lamp_keepalive_interval") == 0) {
+            get_int_value(&_lamp_keepalive_interval, delimiters);
+        } else if (strcmp(string, "bitrate_controller") == 0) {
+            get_string_value(&_bitrate_controller, delimiters);
+        } else if (strcmp(string, "bitrate_min") == 0) {
+            get_int_value(&_bitrate_min, delimiters);
+        } else if (strcmp(string, "bitrate_max") == 0) {
+            get_int_value(&_bitrate_max, delimiters);
+        } else if (strcmp(string, "bitrate_hysteresis") == 0) {
+            get_int_value(&_bitrate_hysteresis, delimiters);
+        } else if (strcmp(string, "bitrate_min_interval") == 0) {
+            get_int_value(&_bitrate_min_interval, delimiters);
+        } else if (strcmp(string, "bitrate_idr_min_interval") == 0) {
+            get_int_value(&_bitrate_idr_min_interval, delimiters);
+        } else if (strcmp(string, "bitrate_ramp_holdoff") == 0) {
+            get_int_value(&_bitrate_ramp_holdoff, delimiters);
+        } else if (strcmp(string, "link_predictor_enabled") == 0) {
+            get_bool_value(&_link_predictor_enabled, delimiters);
+        } else if (strcmp(string, "link_predictor_horizon") == 0) {
+            get_int_value(&_link_predictor_horizon, delimiters);
+        } else if (strcmp(string, "link_predictor_cut") == 0) {
+            get_int_value(&_link_predictor_cut, delimiters);
+        } else if (strcmp(string, "d2d_combine_rule") == 0) {
+            get_string_value(&_d2d_combine_rule, delimiters);
+        } else if (strcmp(string, "d2d_source_timeout") == 0) {
+            get_int_value(&_d2d_source_timeout, delimiters);
+        } else if (strcmp(string, "radio_status_interval") == 0) {
+            get_int_value(&_radio_status_interval, delimiters);
+        } else if (strcmp(string, "rc_link_interval") == 0) {
+            get_int_value(&_rc_link_interval, delimiters);
+        } else if (strcmp(string, "board_telemetry_interval") == 0) {
+            get_int_value(&_board_telemetry_interval, delimiters);
+        } else if (strcmp(string, "telemetry_budget_fraction") == 0) {
+            get_int_value(&_telemetry_budget_fraction, delimiters);
+        } else if (strcmp(string, "time_sync_client_rate") == 0) {
+            get_int_value(&_time_sync_client_rate, delimiters);
+        } else if (strcmp(string, "time_sync_server_id") == 0) {
+            get_int_value(&_time_sync_server_id, delimiters);
         } else if (strcmp(string, "board_control_enabled") == 0) {
             get_bool_value(&_board_control_enabled, delimiters);
         } else if (strcmp(string, "camera_control_enabled") == 0) {
@@ -35,6 +35,27 @@ public:
 	char* get_router_controller_name();
     int get_cpu_temperature_high_value();
     int get_battery_level_low_value();
+    int get_cpu_temperature_hysteresis();
+    int get_battery_level_hysteresis();
+    int get_lamp_keepalive_interval();
+    char* get_bitrate_controller();
+    int get_bitrate_min();
+    int get_bitrate_max();
+    int get_bitrate_hysteresis();
+    int get_bitrate_min_interval();
+    int get_bitrate_idr_min_interval();
+    int get_bitrate_ramp_holdoff();
+    bool get_link_predictor_enabled();
+    int get_link_predictor_horizon();
+    int get_link_predictor_cut();
+    char* get_d2d_combine_rule();
+    int get_d2d_source_timeout();
+    int get_radio_status_interval();
+    int get_rc_link_interval();
+    int get_board_telemetry_interval();
+    int get_telemetry_budget_fraction();
+    int get_time_sync_client_rate();
+    int get_time_sync_server_id();
     bool get_board_control_enabled();
     bool get_camera_control_enabled();
     bool get_wifi_control_enabled();
@@ -64,6 +85,27 @@ private:
     char* _router_controller_name;
     int _cpu_temperature_high_value;
     int _battery_level_low_value;
+    int _cpu_temperature_hysteresis;
+    int _battery_level_hysteresis;
+    int _lamp_keepalive_interval;
+    char* _bitrate_controller;
+    int _bitrate_min;
+    int _bitrate_max;
+    int _bitrate_hysteresis;
+    int _bitrate_min_interval;
+    int _bitrate_idr_min_interval;
+    int _bitrate_ramp_holdoff;
+    bool _link_predictor_enabled;
+    int _link_predictor_horizon;
+    int _link_predictor_cut;
+    char* _d2d_combine_rule;
+    int _d2d_source_timeout;
+    int _radio_status_interval;
+    int _rc_link_interval;
+    int _board_telemetry_interval;
+    int _telemetry_budget_fraction;
+    int _time_sync_client_rate;
+    int _time_sync_server_id;
     bool _board_control_enabled;
     bool _camera_control_enabled;
     bool _wifi_control_enabled;
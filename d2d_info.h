@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdint.h>
+
+typedef enum {
+    CONNECTED = 0,
+    DISCONNECTED
+} D2D_SERVICE_STATUS;
+
+struct d2d_info {
+    /* used by QGC at controller side */
+    D2D_SERVICE_STATUS service_status;    // connected or disconnected
+    int rsrp;                             // LTE signal strength in "dBm"
+    /* used by camera module at plane side */
+    int ul_bandwidth;                     // uplink granted bandwidth in "kbps"
+    int ul_rate;                          // uplink bit rate in "kbps"
+    int snr;                              // signal-to-noise radio in "dB"
+    uint64_t timestamp;                   // producer time in "us", 0 for text messages
+};
@@ -19,21 +19,25 @@
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <endian.h>
 
 #include <utils/Log.h>
 #include <cutils/sockets.h>
 #include <cutils/properties.h>
 #include "config.h"
+#include "link_state.h"
+#include "telemetry_budget.h"
 #include "d2d_tracker.h"
 
 #undef LOG_TAG
 #define LOG_TAG "D2dTracker"
-#define D2D_SOCKET_NAME "d2dinfo"
+#define RADIO_STATUS_MAX_INTERVAL_MS 5000
 #define D2D_MAX_MESSAGE_BYTES 100
-#define RADIO_PACK_INTERVAL 500
+#define D2D_LENGTH_BYTES 4
 // potential need for dual controllers
 #define SOCKET_MAX_NUM 2
 
@@ -46,16 +50,55 @@
 
 D2dTracker::D2dTracker() : ModuleThread{"D2dTracker"}
 {
-    char prop_buf[10] = {0};
-    _last_tp_snr = 100;
-    _last_service_status = DISCONNECTED;
+    char prop_buf[PROPERTY_VALUE_MAX] = {0};
+    int adjust_mode;
+    bitrate_params params;
+    Config* config = Config::get_instance();
+
     property_get("persist.camera.bitrate.adjust.mode", prop_buf, "0");
-    _bit_rate_adjust_mode = atoi(prop_buf); // 0: by throughput  1: by snr
+    adjust_mode = atoi(prop_buf); // 0: by throughput  1: by snr
+    params.min_bitrate = config->get_bitrate_min();
+    params.max_bitrate = config->get_bitrate_max();
+    params.hysteresis = config->get_bitrate_hysteresis();
+    params.min_interval_ms = config->get_bitrate_min_interval();
+    params.idr_min_interval_ms = config->get_bitrate_idr_min_interval();
+    params.ramp_holdoff_ms = config->get_bitrate_ramp_holdoff();
+    // the property allows switching controllers without editing the config
+    property_get("persist.camera.bitrate.controller", prop_buf,
+                 config->get_bitrate_controller());
+    _bitrate_controller = BitrateController::create(prop_buf, adjust_mode, params);
+    ALOGI("bitrate controller %s, adjust mode %d", _bitrate_controller->get_name(), adjust_mode);
+    if (!strcmp(config->get_d2d_combine_rule(), "worst")) {
+        _combine_rule = D2D_COMBINE_WORST;
+    } else if (!strcmp(config->get_d2d_combine_rule(), "weighted")) {
+        _combine_rule = D2D_COMBINE_WEIGHTED;
+    } else {
+        _combine_rule = D2D_COMBINE_BEST;
+    }
+    _source_timeout_ms = config->get_d2d_source_timeout();
+    _last_source = nullptr;
+    // the predictor always runs so its hit rate can be checked before
+    // letting it act on the bitrate
+    _link_predictor = new LinkPredictor(&_link_history, config->get_link_predictor_horizon());
+    if (config->get_link_predictor_enabled()) {
+        _bitrate_controller->set_predictor(_link_predictor, config->get_link_predictor_cut());
+    }
     _d2d_info_fd = -1;
+    _stats_fd = -1;
     _rc_fd = -1;
     _router_fd = -1;
-    _last_radio_pack_time = 0;
+    _rc_stream = -1;
+    _radio_stream = -1;
+    _radio_budget = -1;
+    _rssi = 0;
+    _noise = 0;
     bzero((void*)&_d2d_info, sizeof(_d2d_info));
+    for (int i = 0; i < D2D_MAX_CONNECTIONS; i++) {
+        _connections[i].fd = -1;
+        _connections[i].len = 0;
+        _reset_source(&_connections[i].source);
+    }
+    _reset_source(&_shared_source);
 
 }
 
@@ -79,13 +122,23 @@ bool D2dTracker::_open_socket()
         return false;
     }
     listen(_d2d_info_fd, SOCKET_MAX_NUM);
+    fcntl(_d2d_info_fd, F_SETFL, fcntl(_d2d_info_fd, F_GETFL, 0) | O_NONBLOCK);
     _add_read_fd(_d2d_info_fd, TYPE_OTHER_FD);
 
+    // socket answering link statistics queries, any datagram gets the
+    // current link_stats back
+    _stats_fd = _get_domain_socket(D2D_STATS_SOCKET_NAME, TYPE_DOMAIN_SOCK_ABSTRACT);
+    if (_stats_fd < 0 || !_add_read_fd(_stats_fd, TYPE_DATAGRAM_SOCK_FD)) {
+        ALOGE("fail to create d2d stats socket");
+    }
+
     // socket to send message to rc service
     if (strlen(Config::get_instance()->get_rc_socket_name()) > 0) {
         _rc_fd = _get_domain_socket(NULL, 0);
         if(_rc_fd < 0) {
             ALOGE("fail to create rc socket");
+        } else {
+            _rc_stream = _add_stream("rc_link", Config::get_instance()->get_rc_link_interval());
         }
     }
     // socket to send message to mavlink router
@@ -93,171 +146,493 @@ bool D2dTracker::_open_socket()
         _router_fd = _get_domain_socket(NULL, 0);
         if(_router_fd < 0) {
             ALOGE("fail to create router socket");
+        } else {
+            _radio_stream = _add_stream("radio_status",
+                                        Config::get_instance()->get_radio_status_interval());
+            _radio_budget = TelemetryBudget::get_instance()->add_producer(
+                "radio_status", TELEMETRY_PRIORITY_MEDIUM,
+                MAVLINK_NUM_NON_PAYLOAD_BYTES + MAVLINK_MSG_ID_RADIO_STATUS_LEN,
+                Config::get_instance()->get_radio_status_interval(), RADIO_STATUS_MAX_INTERVAL_MS);
         }
     }
     return true;
 }
 
 bool D2dTracker::_handle_read(int fd, int type)
+{
+    d2d_connection* conn;
+
+    if ((fd == _d2d_info_fd) && (type == TYPE_OTHER_FD)) {
+        _accept_connections();
+        return true;
+    }
+    if (type == TYPE_DATAGRAM_SOCK_FD || type == TYPE_TIMER_FD) {
+        return ModuleThread::_handle_read(fd, type);
+    }
+    if (type != TYPE_STREAM_SOCK_FD || (conn = _find_connection(fd)) == nullptr) {
+        return false;
+    }
+    // the connection may be closed by now, its update is kept all the same
+    if (!_read_connection(conn)) {
+        return false;
+    }
+    return _process_d2d_info();
+}
+
+bool D2dTracker::_process_data(int fd, uint8_t* buf, int len,
+                               struct sockaddr* src_addr, int addrlen)
+{
+    link_stats stats;
+
+    if (fd != _stats_fd) {
+        return false;
+    }
+    // an unbound client has no address to answer to
+    if (addrlen <= (int)offsetof(struct sockaddr_un, sun_path)) {
+        ALOGE("d2d stats query from unbound socket, ignore");
+        return false;
+    }
+    _link_history.get_stats(&stats);
+    return _send_message(fd, &stats, sizeof(stats), src_addr, addrlen);
+}
+
+void D2dTracker::_accept_connections()
 {
     int acceptFD;
-    int length;
+    int i;
     struct sockaddr peeraddr;
-    socklen_t socklen = sizeof(peeraddr);
+    socklen_t socklen;
+
+    while (true) {
+        socklen = sizeof(peeraddr);
+        acceptFD = accept4(_d2d_info_fd, &peeraddr, &socklen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (acceptFD < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ALOGE("error accepting on d2d socket: %d\n", errno);
+            }
+            return;
+        }
+        ALOGV("D2dTracker accept done");
 
-    if((fd != _d2d_info_fd) || (type != TYPE_OTHER_FD)) {
-       return false;
+        for (i = 0; i < D2D_MAX_CONNECTIONS; i++) {
+            if (_connections[i].fd < 0) {
+                break;
+            }
+        }
+        if (i == D2D_MAX_CONNECTIONS || !_add_read_fd(acceptFD, TYPE_STREAM_SOCK_FD)) {
+            ALOGE("no room for d2d connection, close it");
+            close(acceptFD);
+            continue;
+        }
+        _connections[i].fd = acceptFD;
+        _connections[i].len = 0;
+        _reset_source(&_connections[i].source);
     }
-    acceptFD = accept(fd, &peeraddr, &socklen);
-    ALOGV("D2dTracker accept done");
+}
 
-    if (acceptFD < 0) {
-       ALOGE("error accepting on d2d socket: %d\n", errno);
-       return false;
+// a zeroed d2d_info would read as connected
+void D2dTracker::_reset_source(d2d_source* source)
+{
+    bzero((void*)&source->info, sizeof(source->info));
+    source->info.service_status = DISCONNECTED;
+    source->update_ms = 0;
+}
+
+d2d_connection* D2dTracker::_find_connection(int fd)
+{
+    int i;
+
+    for (i = 0; i < D2D_MAX_CONNECTIONS; i++) {
+        if (_connections[i].fd == fd) {
+            return &_connections[i];
+        }
     }
+    return nullptr;
+}
 
-    length = _read_d2d_info(acceptFD);
-    if (length <= 0) {
-        return false;
+void D2dTracker::_close_connection(d2d_connection* conn)
+{
+    ALOGV("close d2d connection %d", conn->fd);
+    _remove_fd(conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->len = 0;
+    // a producer sending one snapshot per connection still counts until
+    // its state goes stale
+    if (conn->source.update_ms != 0 && conn->source.update_ms >= _shared_source.update_ms) {
+        _shared_source = conn->source;
     }
-    close(acceptFD);
+    _reset_source(&conn->source);
+}
 
-    return _process_d2d_info();
+// Reads what is available on the connection and handles every complete
+// message in it, each framed as a 4 byte network order length and a body.
+// Returns true if at least one message updated a source.
+bool D2dTracker::_read_connection(d2d_connection* conn)
+{
+    ssize_t r;
+    uint32_t msg_len;
+    uint32_t offset;
+    bool updated = false;
+
+    while (true) {
+        r = recv(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len, 0);
+        if (r == 0) {
+            ALOGV("Hit EOS on d2d connection");
+            _close_connection(conn);
+            return updated;
+        }
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ALOGE("error reading d2d connection: %d", errno);
+                _close_connection(conn);
+            }
+            return updated;
+        }
+        conn->len += r;
+        ALOGV("read %zd bytes from socket", r);
+
+        offset = 0;
+        while (conn->len - offset >= D2D_LENGTH_BYTES) {
+            memcpy(&msg_len, conn->buf + offset, D2D_LENGTH_BYTES);
+            msg_len = ntohl(msg_len);
+            if (msg_len == 0 || msg_len > D2D_MAX_MESSAGE_BYTES) {
+                ALOGE("invalid d2d info message length %u, drop connection", msg_len);
+                _close_connection(conn);
+                return updated;
+            }
+            if (conn->len - offset < D2D_LENGTH_BYTES + msg_len) {
+                break;
+            }
+            if (_parse_d2d_message(conn, conn->buf + offset + D2D_LENGTH_BYTES, msg_len)) {
+                updated = true;
+            }
+            offset += D2D_LENGTH_BYTES + msg_len;
+        }
+        if (offset > 0) {
+            memmove(conn->buf, conn->buf + offset, conn->len - offset);
+            conn->len -= offset;
+        }
+    }
 }
 
-int D2dTracker::_read_d2d_info(int socket) {
-    char buffer[D2D_MAX_MESSAGE_BYTES] = {0};
+bool D2dTracker::_parse_d2d_message(d2d_connection* conn, const uint8_t* body, uint32_t len)
+{
+    char buffer[D2D_MAX_MESSAGE_BYTES + 1];
+    d2d_info* info = &_shared_source.info;
     char delims[] = " ";
     char *msg_tag = NULL;
     char *value   = NULL;
-    int  msg_len  = 0;
-    int  read_len = 0;
-
-    // First, read the length of the message
-    read_len = recv(socket, &msg_len, sizeof(int), 0);
-    ALOGV("read %d bytes from socket", read_len);
-    if (read_len <= 0) {
-        ALOGV("Hit EOS reading message length");
-        return -1;
-    } else {
-        msg_len = ntohl(msg_len);
-        ALOGV("the length of received d2d info message is %d bytes", msg_len);
-    }
+    char *saveptr = NULL;
+    uint16_t magic;
 
-    // Then, read the message body with specific length
-    read_len = recv(socket, &buffer, msg_len, 0);
-    ALOGV("read %d bytes from socket", read_len);
-    if (read_len <= 0) {
-        ALOGE("Hit EOS reading message length, failed to read message body");
-        return -1;
+    if (len >= sizeof(magic)) {
+        memcpy(&magic, body, sizeof(magic));
+        if (ntohs(magic) == D2D_TLV_MAGIC) {
+            return _parse_d2d_tlv(conn, body, len);
+        }
     }
 
-    msg_tag = strtok(buffer, delims);
+    memcpy(buffer, body, len);
+    buffer[len] = '\0';
+
+    msg_tag = strtok_r(buffer, delims, &saveptr);
     if (msg_tag != NULL) {
-        value = strtok(NULL, delims);
+        value = strtok_r(NULL, delims, &saveptr);
         if (value == NULL) {
             ALOGE("subsequent strtok failed, ignore");
-            return -1;
+            return false;
         }
 
         if (!strcmp(msg_tag, D2D_SERVICE_STATUS_TAG)) {
-            _d2d_info.service_status = (!strcmp(value, "1")) ? CONNECTED : DISCONNECTED;
+            info->service_status = (!strcmp(value, "1")) ? CONNECTED : DISCONNECTED;
         } else if (!strcmp(msg_tag, D2D_SIGNAL_STRENGTH_TAG)) {
-            _d2d_info.rsrp = atoi(value);
+            info->rsrp = atoi(value);
         } else if (!strcmp(msg_tag, D2D_UL_GRANT_BANDWIDTH_TAG)) {
-            _d2d_info.ul_bandwidth = atoi(value);
+            info->ul_bandwidth = atoi(value);
         } else if (!strcmp(msg_tag, D2D_UL_DATA_RATE_TAG)) {
-            _d2d_info.ul_rate = atoi(value);
+            info->ul_rate = atoi(value);
         } else if (!strcmp(msg_tag, D2D_SNR_TAG)) {
-            _d2d_info.snr = atoi(value);
+            info->snr = atoi(value);
         } else {
            ALOGE("unknown d2d info message tag, ignore");
-           return -1;
+           return false;
         }
+        info->timestamp = 0;
+        _shared_source.update_ms = _get_monotonic_ms();
     } else {
         ALOGE("strtok failed, ignore");
-        return -1;
+        return false;
+    }
+
+    ALOGV("d2d_info from %d: service_status = %d, rsrp = %d, ul_bandwidth = %d, ul_rate = %d, snr = %d",
+           conn->fd,
+           info->service_status,
+           info->rsrp,
+           info->ul_bandwidth,
+           info->ul_rate,
+           info->snr);
+    return true;
+}
+
+// Parses a binary snapshot into a copy of the source info and only commits it
+// when the whole message is valid.
+bool D2dTracker::_parse_d2d_tlv(d2d_connection* conn, const uint8_t* body, uint32_t len)
+{
+    d2d_tlv_header header;
+    d2d_info info = conn->source.info;
+    uint32_t offset = sizeof(header);
+    uint8_t type;
+    uint8_t value_len;
+    int32_t value;
+    int i;
+
+    if (len < sizeof(header)) {
+        ALOGE("d2d tlv message too short %u", len);
+        return false;
+    }
+    memcpy(&header, body, sizeof(header));
+    if (header.version != D2D_TLV_VERSION) {
+        ALOGE("unsupported d2d tlv version %d", header.version);
+        return false;
+    }
+    info.timestamp = be64toh(header.timestamp);
+
+    for (i = 0; i < header.count; i++) {
+        if (len - offset < 2) {
+            ALOGE("truncated d2d tlv %d", i);
+            return false;
+        }
+        type = body[offset];
+        value_len = body[offset + 1];
+        offset += 2;
+        if (len - offset < value_len) {
+            ALOGE("truncated d2d tlv %d value", i);
+            return false;
+        }
+        if (type < D2D_TLV_SERVICE_STATUS || type > D2D_TLV_SNR) {
+            // added by a newer producer, skip it
+            offset += value_len;
+            continue;
+        }
+        if (value_len != sizeof(value)) {
+            ALOGE("invalid length %d for d2d tlv type %d", value_len, type);
+            return false;
+        }
+        memcpy(&value, body + offset, sizeof(value));
+        value = (int32_t)ntohl(value);
+        offset += value_len;
+
+        switch (type) {
+        case D2D_TLV_SERVICE_STATUS:
+            info.service_status = value ? CONNECTED : DISCONNECTED;
+            break;
+        case D2D_TLV_RSRP:
+            info.rsrp = value;
+            break;
+        case D2D_TLV_UL_BANDWIDTH:
+            info.ul_bandwidth = value;
+            break;
+        case D2D_TLV_UL_RATE:
+            info.ul_rate = value;
+            break;
+        case D2D_TLV_SNR:
+            info.snr = value;
+            break;
+        }
     }
 
-    ALOGV("d2d_info: service_status = %d, rsrp = %d, ul_bandwidth = %d, ul_rate = %d, snr = %d",
-           _d2d_info.service_status,
-           _d2d_info.rsrp,
-           _d2d_info.ul_bandwidth,
-           _d2d_info.ul_rate,
-           _d2d_info.snr);
-    return msg_len;
+    conn->source.info = info;
+    conn->source.update_ms = _get_monotonic_ms();
+    ALOGV("d2d_info from %d at %llu: service_status = %d, rsrp = %d, ul_bandwidth = %d, ul_rate = %d, snr = %d",
+           conn->fd, (unsigned long long)info.timestamp,
+           info.service_status,
+           info.rsrp,
+           info.ul_bandwidth,
+           info.ul_rate,
+           info.snr);
+    return true;
 }
 
-bool D2dTracker::_process_d2d_info()
+// Orders links for the best and worst rules: connected before disconnected,
+// then by granted bandwidth and snr.
+static int compare_links(const d2d_info& a, const d2d_info& b)
 {
-    int len;
-    uint8_t packet[MAVLINK_MAX_PACKET_LEN];
-    uint8_t rssi;
-    uint8_t noise;
+    if (a.service_status != b.service_status) {
+        return (a.service_status == CONNECTED) ? 1 : -1;
+    }
+    if (a.ul_bandwidth != b.ul_bandwidth) {
+        return (a.ul_bandwidth > b.ul_bandwidth) ? 1 : -1;
+    }
+    return a.snr - b.snr;
+}
 
-#ifdef CAMERA_EXIST
-    CameraService* _camera_service = CameraService::get_instance();
-    if(_d2d_info.service_status == CONNECTED) {
-        if(_bit_rate_adjust_mode == 0) {
-            if (_d2d_info.ul_bandwidth != _last_tp_snr) {
-                _last_tp_snr = _d2d_info.ul_bandwidth;
-                _camera_service->set_bitrate(_last_tp_snr);
-                ALOGV("received tp is %d", _last_tp_snr);
+// Builds _d2d_info from the sources updated within the timeout, the open
+// connections and the shared one. Returns false if there is no such
+// source, _d2d_info is then left as it was.
+bool D2dTracker::_combine_sources(uint64_t now_ms)
+{
+    d2d_source* chosen = nullptr;
+    d2d_source* source;
+    int64_t sum[4] = {0, 0, 0, 0};
+    int64_t total = 0;
+    int64_t weight;
+    uint64_t age;
+    int sources = 0;
+    int connected = 0;
+    int chosen_id = -1;
+    int i;
+
+    for (i = 0; i <= D2D_MAX_CONNECTIONS; i++) {
+        if (i < D2D_MAX_CONNECTIONS) {
+            if (_connections[i].fd < 0) {
+                continue;
             }
-        }else {
-            if (_d2d_info.snr != _last_tp_snr) {
-                _last_tp_snr = _d2d_info.snr;
-                _camera_service->set_bitrate(_last_tp_snr);
-                ALOGV("received snr is %d", _last_tp_snr);
+            source = &_connections[i].source;
+        } else {
+            source = &_shared_source;
+        }
+        if (source->update_ms == 0) {
+            continue;
+        }
+        age = now_ms - source->update_ms;
+        if (age > _source_timeout_ms) {
+            ALOGV("d2d source %d is stale, %llu ms", i, (unsigned long long)age);
+            continue;
+        }
+        sources++;
+        if (_combine_rule == D2D_COMBINE_WEIGHTED) {
+            if (source->info.service_status != CONNECTED) {
+                continue;
             }
+            // a source fades out as it goes stale instead of dropping at once
+            weight = _source_timeout_ms - age + 1;
+            sum[0] += weight * source->info.rsrp;
+            sum[1] += weight * source->info.ul_bandwidth;
+            sum[2] += weight * source->info.ul_rate;
+            sum[3] += weight * source->info.snr;
+            total += weight;
+            connected++;
+            chosen = source;
+        } else if (chosen == nullptr ||
+                   (_combine_rule == D2D_COMBINE_BEST && compare_links(source->info, chosen->info) > 0) ||
+                   (_combine_rule == D2D_COMBINE_WORST && compare_links(source->info, chosen->info) < 0)) {
+            chosen = source;
+            chosen_id = i;
         }
-    } else {
-        _camera_service->set_bitrate(-99);   //-99 will indicate codec to enter the dummy state
-        ALOGD("indicate codec to enter the dummy state");
+    }
+    if (sources == 0) {
+        return false;
     }
 
-    if ((_d2d_info.service_status == CONNECTED) &&  (_last_service_status == DISCONNECTED)) {
+    if (_combine_rule == D2D_COMBINE_WEIGHTED) {
+        if (connected == 0) {
+            _d2d_info.service_status = DISCONNECTED;
+            return true;
+        }
+        _d2d_info.service_status = CONNECTED;
+        _d2d_info.rsrp = sum[0] / total;
+        _d2d_info.ul_bandwidth = sum[1] / total;
+        _d2d_info.ul_rate = sum[2] / total;
+        _d2d_info.snr = sum[3] / total;
+        // producer clocks differ, only a single source keeps its timestamp
+        _d2d_info.timestamp = (connected == 1) ? chosen->info.timestamp : 0;
+        return true;
+    }
+    if (chosen != _last_source) {
+        // D2D_MAX_CONNECTIONS is the shared source
+        ALOGD("d2d source switched to %d", chosen_id);
+        _last_source = chosen;
+    }
+    _d2d_info = chosen->info;
+    return true;
+}
+
+bool D2dTracker::_process_d2d_info()
+{
+    uint64_t msec = _get_monotonic_ms();
+    bitrate_decision decision;
+
+    if (!_combine_sources(msec)) {
+        return false;
+    }
+    LinkState::get_instance()->publish(_d2d_info, msec);
+    _link_history.add(_d2d_info, msec);
+    _link_predictor->update(_d2d_info, msec);
+    decision = _bitrate_controller->update(_d2d_info, msec);
+#ifdef CAMERA_EXIST
+    CameraService* _camera_service = CameraService::get_instance();
+    if (decision.set_bitrate) {
+        _camera_service->set_bitrate(decision.bitrate);
+        ALOGV("set bitrate %d", decision.bitrate);
+    }
+    if (decision.request_idr) {
         _camera_service->request_idr();
-        ALOGD("reconnected, request idr, service_status is %d", _d2d_info.service_status);
     }
-    _last_service_status = _d2d_info.service_status;
+#else
+    (void) decision;
 #endif
 
-    // calculate rssi and noise
-    if ((_d2d_info.rsrp > 0) || (_d2d_info.rsrp < -255)
-        || (_d2d_info.rsrp - _d2d_info.snr > 0)
-        || (_d2d_info.rsrp - _d2d_info.snr < -255)) {
-            ALOGE("received rsrp or snr is out of range!!! %d %d",
-                   _d2d_info.rsrp, _d2d_info.snr);
-            return false;
+    if (!_get_rssi_noise(_d2d_info.rsrp, _d2d_info.snr, &_rssi, &_noise)) {
+        return false;
     }
-    rssi = abs(_d2d_info.rsrp);
-    noise = abs(_d2d_info.rsrp - _d2d_info.snr);
+    // the messages are built from the latest state when their stream is due
+    _update_stream(_rc_stream);
+    _update_stream(_radio_stream);
+    return true;
+}
+
+void D2dTracker::_send_stream(int stream)
+{
+    int len;
+    uint8_t packet[MAVLINK_MAX_PACKET_LEN];
+    uint8_t rssi = _rssi;
+    uint8_t noise = _noise;
+    link_stats stats;
+    uint64_t now_ms;
 
-    // send msg to rc service, 2 bytes: 1:rssi, 2:noise
-    if(_rc_fd >= 0) {
+    if (stream == _rc_stream) {
+        // send msg to rc service, 2 bytes: 1:rssi, 2:noise
         packet[0] = rssi;
         packet[1] = noise;
         _send_message(_rc_fd, packet, 2,
                       Config::get_instance()->get_rc_socket_name(),
                       TYPE_DOMAIN_SOCK);
+    } else if (stream == _radio_stream) {
+        // over budget the tick is dropped, the next d2d update marks the
+        // stream again
+        now_ms = _get_monotonic_ms();
+        if (!TelemetryBudget::get_instance()->allow(_radio_budget, now_ms)) {
+            return;
+        }
+        // report the smoothed link rather than the last sample, as long as
+        // the history still describes the link; it only holds connected
+        // samples and keeps them after the link drops or goes quiet
+        _link_history.get_stats(&stats);
+        if (stats.count > 0 && _d2d_info.service_status == CONNECTED &&
+            now_ms - stats.newest_ms <= _source_timeout_ms) {
+            _get_rssi_noise(stats.field[LINK_FIELD_RSRP].ewma,
+                            stats.field[LINK_FIELD_SNR].ewma, &rssi, &noise);
+        }
+        len = _get_radio_packet(packet, rssi, noise);
+        _send_message(_router_fd, packet, len,
+                      Config::get_instance()->get_board_endpoint_name(),
+                      TYPE_DOMAIN_SOCK_ABSTRACT);
     }
+}
 
-    // send msg to mavlink router
-    if (_router_fd >= 0) {
-        timespec ts;
-        uint64_t msec;
-        clock_gettime(CLOCK_MONOTONIC, &ts);
-        msec = ts.tv_sec * 1000  + ts.tv_nsec / 1000000;
-        if (msec - _last_radio_pack_time >= RADIO_PACK_INTERVAL) {
-            _last_radio_pack_time = msec;
-
-            len = _get_radio_packet(packet, rssi, noise);
-            _send_message(_router_fd, packet, len,
-                          Config::get_instance()->get_board_endpoint_name(),
-                          TYPE_DOMAIN_SOCK_ABSTRACT);
-        }
+// calculate rssi and noise
+bool D2dTracker::_get_rssi_noise(int rsrp, int snr, uint8_t* rssi, uint8_t* noise)
+{
+    if ((rsrp > 0) || (rsrp < -255) || (rsrp - snr > 0) || (rsrp - snr < -255)) {
+        ALOGE("received rsrp or snr is out of range!!! %d %d", rsrp, snr);
+        return false;
     }
+    *rssi = abs(rsrp);
+    *noise = abs(rsrp - snr);
     return true;
 }
 
@@ -17,44 +17,115 @@
 #pragma once
 
 #include "module_thread.h"
+#include "d2d_info.h"
+#include "bitrate_controller.h"
+#include "link_history.h"
+#include "link_predictor.h"
 #ifdef CAMERA_EXIST
 #include "camera_service.h"
 #endif
 
-typedef enum {
-    CONNECTED = 0,
-    DISCONNECTED
-} D2D_SERVICE_STATUS;
-
-struct d2d_info {
-    /* used by QGC at controller side */
-    D2D_SERVICE_STATUS service_status;    // connected or disconnected
-    int rsrp;                             // LTE signal strength in "dBm"
-    /* used by camera module at plane side */
-    int ul_bandwidth;                     // uplink granted bandwidth in "kbps"
-    int ul_rate;                          // uplink bit rate in "kbps"
-    int snr;                              // signal-to-noise radio in "dB"
+#define D2D_SOCKET_NAME         "d2dinfo"     // stream, framed d2d info messages
+#define D2D_STATS_SOCKET_NAME   "d2dstats"    // datagram, link_stats queries
+
+/*
+ * Binary d2d info message, carries a full link snapshot in one frame.
+ * All multi-byte fields are in network byte order. The header is followed
+ * by `count` TLVs of type (1 byte), length (1 byte) and value; metric
+ * values are 4 byte signed integers. Unknown types are skipped, so new
+ * metrics are added as new types under the same version; the version is
+ * only raised for a layout change, and other versions are rejected.
+ * Messages not starting with the magic are parsed as the legacy
+ * "TAG value" text.
+ */
+#define D2D_TLV_MAGIC           0xD2D0
+#define D2D_TLV_VERSION         1
+
+struct __attribute__((packed)) d2d_tlv_header {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t count;
+    uint64_t timestamp;                   // producer time in "us"
+};
+
+enum {
+    D2D_TLV_SERVICE_STATUS = 1,           // 1: connected, 0: disconnected
+    D2D_TLV_RSRP,
+    D2D_TLV_UL_BANDWIDTH,
+    D2D_TLV_UL_RATE,
+    D2D_TLV_SNR,
+};
+
+#define D2D_MAX_CONNECTIONS 4
+#define D2D_RX_BUF_SIZE 512
+
+// how the link states of several d2d sources become the one the encoder
+// and RADIO_STATUS see
+enum {
+    D2D_COMBINE_BEST = 0,               // the source with the most bandwidth
+    D2D_COMBINE_WORST,                  // the source with the least bandwidth
+    D2D_COMBINE_WEIGHTED,               // connected sources averaged by freshness
+};
+
+// link state reported by one d2d source
+struct d2d_source {
+    d2d_info info;
+    uint64_t update_ms;                 // last update, 0 if none yet
+};
+
+// a connection from the d2d service, kept open across messages; its TLV
+// snapshots make it a source of its own
+struct d2d_connection {
+    int fd;
+    uint32_t len;                       // bytes buffered in buf
+    uint8_t buf[D2D_RX_BUF_SIZE];
+    d2d_source source;
 };
 
 class D2dTracker : public ModuleThread {
 public:
     D2dTracker();
     virtual bool start() override;
+    // for readers on other threads, see LinkHistory::get_stats()
+    LinkHistory* get_link_history() { return &_link_history; }
 
 protected:
     virtual bool _handle_read(int fd, int type) override;
+    virtual bool _process_data(int fd, uint8_t* buf, int len,
+                               struct sockaddr* src_addr, int addrlen) override;
+    virtual void _send_stream(int stream) override;
     bool _open_socket();
-    int _read_d2d_info(int fd);
+    void _accept_connections();
+    bool _read_connection(d2d_connection* conn);
+    void _close_connection(d2d_connection* conn);
+    d2d_connection* _find_connection(int fd);
+    bool _parse_d2d_message(d2d_connection* conn, const uint8_t* body, uint32_t len);
+    bool _parse_d2d_tlv(d2d_connection* conn, const uint8_t* body, uint32_t len);
+    static void _reset_source(d2d_source* source);
+    bool _combine_sources(uint64_t now_ms);
     bool _process_d2d_info();
+    bool _get_rssi_noise(int rsrp, int snr, uint8_t* rssi, uint8_t* noise);
     ssize_t _get_radio_packet(uint8_t *pBuf, uint8_t rssi, uint8_t noise);
 
 private:
-    int _last_tp_snr;
-    int _last_service_status;
-    int _bit_rate_adjust_mode;
+    BitrateController* _bitrate_controller;
+    int _combine_rule;
+    uint32_t _source_timeout_ms;
+    d2d_source* _last_source;
+    LinkHistory _link_history;
+    LinkPredictor* _link_predictor;
     int _d2d_info_fd;
+    int _stats_fd;
     int _rc_fd;
     int _router_fd;
-    uint64_t _last_radio_pack_time;
-    d2d_info _d2d_info;
+    int _rc_stream;
+    int _radio_stream;
+    int _radio_budget;
+    uint8_t _rssi;                      // of the latest combined sample
+    uint8_t _noise;
+    d2d_info _d2d_info;                 // combined over the sources
+    d2d_connection _connections[D2D_MAX_CONNECTIONS];
+    // "TAG value" updates, one field each and often one per connection, and
+    // the last snapshot of connections that closed
+    d2d_source _shared_source;
 };
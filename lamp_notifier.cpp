@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <utils/Log.h>
+#include "lamp_notifier.h"
+
+#undef LOG_TAG
+#define LOG_TAG "LampNotifier"
+
+LampNotifier::LampNotifier(const sp<ISystemStatusListener>& listener)
+    : _listener(listener)
+    , _pending(false)
+    , _temp_state(NOT_WORKING)
+    , _battery_state(NOT_WORKING)
+    , _charging_state(NOT_WORKING)
+{
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+void LampNotifier::post(SystemStatus temp, SystemStatus battery, SystemStatus charging)
+{
+    pthread_mutex_lock(&_lock);
+    _temp_state = temp;
+    _battery_state = battery;
+    _charging_state = charging;
+    _pending = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_lock);
+}
+
+void LampNotifier::_thread_entry()
+{
+    SystemStatus temp;
+    SystemStatus battery;
+    SystemStatus charging;
+
+    while (true) {
+        pthread_mutex_lock(&_lock);
+        while (!_pending) {
+            pthread_cond_wait(&_cond, &_lock);
+        }
+        temp = _temp_state;
+        battery = _battery_state;
+        charging = _charging_state;
+        _pending = false;
+        pthread_mutex_unlock(&_lock);
+
+        ALOGV("notify lamp states %d %d %d", temp, battery, charging);
+        _listener->onStatusChanged(temp, false);
+        _listener->onStatusChanged(battery, false);
+        // only send state when charging is on
+        if (charging > NOT_WORKING) {
+            _listener->onStatusChanged(charging, false);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <ISystemStatusListener.h>
+#include "thread_base.h"
+
+using namespace android;
+
+/*
+ * Delivers lamp states to ISystemStatusListener from its own thread, so a
+ * slow lamp service never blocks the caller. Only the latest set of states
+ * is kept; states posted while a delivery is running replace older ones.
+ */
+class LampNotifier : public ThreadBase {
+public:
+    LampNotifier(const sp<ISystemStatusListener>& listener);
+    void post(SystemStatus temp, SystemStatus battery, SystemStatus charging);
+
+protected:
+    virtual void _thread_entry() override;
+
+private:
+    sp<ISystemStatusListener> _listener;
+    pthread_mutex_t _lock;
+    pthread_cond_t _cond;
+    bool _pending;
+    SystemStatus _temp_state;
+    SystemStatus _battery_state;
+    SystemStatus _charging_state;
+};
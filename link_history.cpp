@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <utils/Log.h>
+
+#include "link_history.h"
+
+#undef LOG_TAG
+#define LOG_TAG "LinkHistory"
+
+#define LINK_HISTORY_MASK       (LINK_HISTORY_SIZE - 1)
+#define LINK_EWMA_SHIFT         3       // smoothing factor 1/8
+
+LinkHistory::LinkHistory()
+    : _seq(0)
+    , _count(0)
+    , _stats_seq(0)
+{
+    bzero((void*)_samples, sizeof(_samples));
+    bzero((void*)_sum, sizeof(_sum));
+    bzero((void*)_ewma, sizeof(_ewma));
+    bzero((void*)_min_head, sizeof(_min_head));
+    bzero((void*)_min_tail, sizeof(_min_tail));
+    bzero((void*)_max_head, sizeof(_max_head));
+    bzero((void*)_max_tail, sizeof(_max_tail));
+    bzero((void*)&_stats, sizeof(_stats));
+    _stats.version = LINK_STATS_VERSION;
+}
+
+void LinkHistory::add(const d2d_info& info, uint64_t now_ms)
+{
+    link_sample* sample;
+    int32_t v;
+    int f;
+
+    // metrics are stale while disconnected
+    if (info.service_status != CONNECTED) {
+        return;
+    }
+    while (_count > 0 &&
+           now_ms - _samples[(_seq - _count) & LINK_HISTORY_MASK].time_ms > LINK_HISTORY_WINDOW_MS) {
+        _evict_oldest();
+    }
+    if (_count == LINK_HISTORY_SIZE) {
+        _evict_oldest();
+    }
+
+    sample = &_samples[_seq & LINK_HISTORY_MASK];
+    sample->time_ms = now_ms;
+    sample->value[LINK_FIELD_SNR] = info.snr;
+    sample->value[LINK_FIELD_RSRP] = info.rsrp;
+    sample->value[LINK_FIELD_UL_BANDWIDTH] = info.ul_bandwidth;
+    sample->value[LINK_FIELD_UL_RATE] = info.ul_rate;
+
+    for (f = 0; f < LINK_FIELD_MAX; f++) {
+        v = sample->value[f];
+        _sum[f] += v;
+        _ewma[f] = (_count == 0) ? v : _ewma[f] + ((v - _ewma[f]) >> LINK_EWMA_SHIFT);
+        // drop the queued samples the new one makes irrelevant
+        while (_min_tail[f] != _min_head[f] &&
+               _samples[_min_queue[f][(_min_tail[f] - 1) & LINK_HISTORY_MASK] & LINK_HISTORY_MASK].value[f] >= v) {
+            _min_tail[f]--;
+        }
+        _min_queue[f][_min_tail[f]++ & LINK_HISTORY_MASK] = _seq;
+        while (_max_tail[f] != _max_head[f] &&
+               _samples[_max_queue[f][(_max_tail[f] - 1) & LINK_HISTORY_MASK] & LINK_HISTORY_MASK].value[f] <= v) {
+            _max_tail[f]--;
+        }
+        _max_queue[f][_max_tail[f]++ & LINK_HISTORY_MASK] = _seq;
+    }
+    _seq++;
+    _count++;
+    _publish();
+}
+
+const link_sample* LinkHistory::get_sample(int age)
+{
+    if (age < 0 || age >= _count) {
+        return nullptr;
+    }
+    return &_samples[(_seq - 1 - age) & LINK_HISTORY_MASK];
+}
+
+void LinkHistory::get_stats(link_stats* stats)
+{
+    uint32_t begin;
+
+    while (true) {
+        begin = _stats_seq.load(std::memory_order_acquire);
+        if (begin & 1) {
+            continue;
+        }
+        memcpy((void*)stats, (void*)&_stats, sizeof(*stats));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (_stats_seq.load(std::memory_order_relaxed) == begin) {
+            return;
+        }
+    }
+}
+
+void LinkHistory::_evict_oldest()
+{
+    uint32_t oldest = _seq - _count;
+    int f;
+
+    for (f = 0; f < LINK_FIELD_MAX; f++) {
+        _sum[f] -= _samples[oldest & LINK_HISTORY_MASK].value[f];
+        if (_min_queue[f][_min_head[f] & LINK_HISTORY_MASK] == oldest) {
+            _min_head[f]++;
+        }
+        if (_max_queue[f][_max_head[f] & LINK_HISTORY_MASK] == oldest) {
+            _max_head[f]++;
+        }
+    }
+    _count--;
+}
+
+void LinkHistory::_publish()
+{
+    link_stats stats;
+    const link_sample* newest = &_samples[(_seq - 1) & LINK_HISTORY_MASK];
+    const link_sample* oldest = &_samples[(_seq - _count) & LINK_HISTORY_MASK];
+    uint32_t seq;
+    int f;
+
+    stats.version = LINK_STATS_VERSION;
+    stats.count = _count;
+    stats.span_ms = newest->time_ms - oldest->time_ms;
+    stats.newest_ms = newest->time_ms;
+    for (f = 0; f < LINK_FIELD_MAX; f++) {
+        link_field_stats* s = &stats.field[f];
+        s->last = newest->value[f];
+        s->min = _samples[_min_queue[f][_min_head[f] & LINK_HISTORY_MASK] & LINK_HISTORY_MASK].value[f];
+        s->max = _samples[_max_queue[f][_max_head[f] & LINK_HISTORY_MASK] & LINK_HISTORY_MASK].value[f];
+        s->mean = _sum[f] / _count;
+        s->ewma = _ewma[f];
+        _fill_percentiles(f, s);
+    }
+
+    seq = _stats_seq.load(std::memory_order_relaxed);
+    _stats_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy((void*)&_stats, (void*)&stats, sizeof(stats));
+    _stats_seq.store(seq + 2, std::memory_order_release);
+}
+
+// p50 first, then p10 and p90 only need to look at their side of it
+void LinkHistory::_fill_percentiles(int field, link_field_stats* stats)
+{
+    int n = _count;
+    int k10 = (n - 1) * 10 / 100;
+    int k50 = (n - 1) * 50 / 100;
+    int k90 = (n - 1) * 90 / 100;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        _scratch[i] = _samples[(_seq - n + i) & LINK_HISTORY_MASK].value[field];
+    }
+    std::nth_element(_scratch, _scratch + k50, _scratch + n);
+    stats->p50 = _scratch[k50];
+    stats->p10 = stats->p50;
+    if (k10 < k50) {
+        std::nth_element(_scratch, _scratch + k10, _scratch + k50);
+        stats->p10 = _scratch[k10];
+    }
+    stats->p90 = stats->p50;
+    if (k90 > k50) {
+        std::nth_element(_scratch + k50 + 1, _scratch + k90, _scratch + n);
+        stats->p90 = _scratch[k90];
+    }
+}
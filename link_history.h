@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include "d2d_info.h"
+
+#define LINK_HISTORY_SIZE       256         // samples, power of two
+#define LINK_HISTORY_WINDOW_MS  60000       // samples older than this are dropped
+#define LINK_STATS_VERSION      1
+
+enum {
+    LINK_FIELD_SNR = 0,
+    LINK_FIELD_RSRP,
+    LINK_FIELD_UL_BANDWIDTH,
+    LINK_FIELD_UL_RATE,
+    LINK_FIELD_MAX
+};
+
+struct link_sample {
+    uint64_t time_ms;
+    int32_t value[LINK_FIELD_MAX];
+};
+
+struct __attribute__((packed)) link_field_stats {
+    int32_t last;
+    int32_t min;
+    int32_t max;
+    int32_t mean;
+    int32_t ewma;
+    int32_t p10;
+    int32_t p50;
+    int32_t p90;
+};
+
+/*
+ * Summary of the connected samples in the window. This is also the reply
+ * of the d2dstats socket, in host byte order; the fields are indexed by
+ * LINK_FIELD_*.
+ */
+struct __attribute__((packed)) link_stats {
+    uint16_t version;
+    uint16_t count;                     // samples in the window
+    uint32_t span_ms;                   // between the oldest and the newest
+    uint64_t newest_ms;                 // CLOCK_MONOTONIC of the newest sample
+    link_field_stats field[LINK_FIELD_MAX];
+};
+
+/*
+ * Fixed-size history of the connected d2d samples of the last minute.
+ * Min, max, mean and ewma are kept up to date as samples come and go, the
+ * percentiles are computed on a scratch copy after each sample. Nothing
+ * is allocated after construction.
+ *
+ * add() and the sample accessors are for the owning thread only. Other
+ * threads read the published summary with get_stats(), which is guarded
+ * by a sequence lock and never blocks the writer.
+ */
+class LinkHistory {
+public:
+    LinkHistory();
+    void add(const d2d_info& info, uint64_t now_ms);
+    // samples added since construction, a sample's sequence never changes
+    uint32_t get_seq() { return _seq; }
+    int get_count() { return _count; }
+    // age 0 is the newest sample, nullptr once the sample has been dropped
+    const link_sample* get_sample(int age);
+    void get_stats(link_stats* stats);
+
+private:
+    void _evict_oldest();
+    void _publish();
+    void _fill_percentiles(int field, link_field_stats* stats);
+
+    link_sample _samples[LINK_HISTORY_SIZE];
+    uint32_t _seq;                      // sequence of the next sample
+    int _count;
+    int64_t _sum[LINK_FIELD_MAX];
+    int32_t _ewma[LINK_FIELD_MAX];
+    // monotonic queues of sample sequences, the front holds the min or max
+    uint32_t _min_queue[LINK_FIELD_MAX][LINK_HISTORY_SIZE];
+    uint32_t _max_queue[LINK_FIELD_MAX][LINK_HISTORY_SIZE];
+    uint32_t _min_head[LINK_FIELD_MAX];
+    uint32_t _min_tail[LINK_FIELD_MAX];
+    uint32_t _max_head[LINK_FIELD_MAX];
+    uint32_t _max_tail[LINK_FIELD_MAX];
+    int32_t _scratch[LINK_HISTORY_SIZE];
+
+    std::atomic<uint32_t> _stats_seq;
+    link_stats _stats;
+};
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <utils/Log.h>
+
+#include "link_predictor.h"
+
+#undef LOG_TAG
+#define LOG_TAG "LinkPredictor"
+
+#define LINK_MIN_SAMPLES        4
+#define LINK_MIN_SPAN_MS        1000
+#define LINK_SNR_LOW            5       // dB
+#define LINK_RSRP_LOW           (-110)  // dBm
+#define LINK_SATURATION_PCT     90      // ul_rate against ul_bandwidth
+#define LINK_DROP_PCT           70      // ul_bandwidth at or below this counts as a drop
+#define LINK_SNR_DROP           6       // dB, same for snr
+
+LinkPredictor::LinkPredictor(LinkHistory* history, uint32_t horizon_ms)
+    : _history(history)
+    , _horizon_ms(horizon_ms)
+    , _last_drop_ms(0)
+{
+    bzero((void*)&_stats, sizeof(_stats));
+    _reset();
+}
+
+void LinkPredictor::update(const d2d_info& info, uint64_t now_ms)
+{
+    const link_sample* sample;
+    uint32_t connected;
+
+    if (info.service_status != CONNECTED) {
+        if (_count > 0) {
+            // losing the link is the drop a prediction was waiting for
+            if (_prediction_ms != 0) {
+                _stats.hits++;
+            } else if (now_ms - _last_drop_ms > 2 * _horizon_ms) {
+                _stats.missed++;
+            }
+            _last_drop_ms = now_ms;
+            ALOGI("predictions %u hits %u false alarms %u missed %u",
+                  _stats.predictions, _stats.hits, _stats.false_alarms, _stats.missed);
+        }
+        _reset();
+        return;
+    }
+
+    connected = _history->get_seq() - _since_seq;
+    _count = connected < LINK_PREDICTOR_WINDOW ? connected : LINK_PREDICTOR_WINDOW;
+    if (_count > _history->get_count()) {
+        _count = _history->get_count();
+    }
+    if (_count == 0) {
+        return;
+    }
+    sample = _history->get_sample(0);
+    _score(sample);
+
+    _degrading = _predict();
+    if (_degrading && _prediction_ms == 0) {
+        ALOGD("link drop predicted, snr %d -> %d",
+              sample->value[LINK_FIELD_SNR], (int)_snr_trend.projected);
+        _stats.predictions++;
+        _prediction_ms = now_ms;
+        _prediction_bandwidth = sample->value[LINK_FIELD_UL_BANDWIDTH];
+        _prediction_snr = sample->value[LINK_FIELD_SNR];
+    }
+}
+
+bool LinkPredictor::_get_trend(int field, link_trend* trend)
+{
+    const link_sample* newest = _history->get_sample(0);
+    const link_sample* oldest = _history->get_sample(_count - 1);
+    const link_sample* s;
+    float mean_t = 0;
+    float mean_v = 0;
+    float sxx = 0;
+    float sxy = 0;
+    float residual = 0;
+    float t;
+    float v;
+    float e;
+    int i;
+
+    if (_count < LINK_MIN_SAMPLES || newest->time_ms - oldest->time_ms < LINK_MIN_SPAN_MS) {
+        return false;
+    }
+    // time in seconds relative to the newest sample
+    for (i = 0; i < _count; i++) {
+        s = _history->get_sample(i);
+        mean_t += -(float)(newest->time_ms - s->time_ms) / 1000;
+        mean_v += s->value[field];
+    }
+    mean_t /= _count;
+    mean_v /= _count;
+    for (i = 0; i < _count; i++) {
+        s = _history->get_sample(i);
+        t = -(float)(newest->time_ms - s->time_ms) / 1000 - mean_t;
+        v = s->value[field] - mean_v;
+        sxx += t * t;
+        sxy += t * v;
+    }
+    trend->slope = sxy / sxx;
+    for (i = 0; i < _count; i++) {
+        s = _history->get_sample(i);
+        t = -(float)(newest->time_ms - s->time_ms) / 1000 - mean_t;
+        e = s->value[field] - mean_v - trend->slope * t;
+        residual += e * e;
+    }
+    trend->stddev = sqrtf(residual / _count);
+    // value of the fitted line now, carried forward over the horizon
+    trend->projected = mean_v + trend->slope * (-mean_t + (float)_horizon_ms / 1000);
+    return true;
+}
+
+// A trend only counts when the drop it projects over the horizon stands out
+// of the noise around it, so a fluctuating but steady link does not trigger.
+bool LinkPredictor::_predict()
+{
+    const link_sample* newest = _history->get_sample(0);
+    float horizon_s = (float)_horizon_ms / 1000;
+    link_trend trend;
+    bool degrading = false;
+
+    if (_get_trend(LINK_FIELD_SNR, &_snr_trend)) {
+        if (_snr_trend.slope < 0 && _snr_trend.projected < LINK_SNR_LOW &&
+            -_snr_trend.slope * horizon_s > _snr_trend.stddev) {
+            degrading = true;
+        }
+    } else {
+        _snr_trend.projected = newest->value[LINK_FIELD_SNR];
+        return false;
+    }
+    if (_get_trend(LINK_FIELD_RSRP, &trend) && trend.slope < 0 &&
+        trend.projected < LINK_RSRP_LOW && -trend.slope * horizon_s > trend.stddev) {
+        degrading = true;
+    }
+    // an uplink running close to its grant with a falling rate is queueing
+    if (newest->value[LINK_FIELD_UL_BANDWIDTH] > 0 &&
+        newest->value[LINK_FIELD_UL_RATE] * 100 >=
+        newest->value[LINK_FIELD_UL_BANDWIDTH] * LINK_SATURATION_PCT &&
+        _get_trend(LINK_FIELD_UL_RATE, &trend) && trend.slope < 0 &&
+        -trend.slope * horizon_s > trend.stddev) {
+        degrading = true;
+    }
+    return degrading;
+}
+
+void LinkPredictor::_score(const link_sample* sample)
+{
+    int bandwidth = sample->value[LINK_FIELD_UL_BANDWIDTH];
+    int max_bandwidth = 0;
+    int i;
+
+    if (_prediction_ms != 0) {
+        if (bandwidth * 100 <= _prediction_bandwidth * LINK_DROP_PCT ||
+            sample->value[LINK_FIELD_SNR] <= _prediction_snr - LINK_SNR_DROP) {
+            ALOGV("prediction hit after %llu ms",
+                  (unsigned long long)(sample->time_ms - _prediction_ms));
+            _stats.hits++;
+            _prediction_ms = 0;
+            _last_drop_ms = sample->time_ms;
+        } else if (sample->time_ms - _prediction_ms > 2 * _horizon_ms) {
+            ALOGV("prediction was a false alarm");
+            _stats.false_alarms++;
+            _prediction_ms = 0;
+        }
+        return;
+    }
+
+    // compare against the samples before this one
+    for (i = 1; i < _count; i++) {
+        if (_history->get_sample(i)->value[LINK_FIELD_UL_BANDWIDTH] > max_bandwidth) {
+            max_bandwidth = _history->get_sample(i)->value[LINK_FIELD_UL_BANDWIDTH];
+        }
+    }
+    if (bandwidth * 100 <= max_bandwidth * LINK_DROP_PCT &&
+        sample->time_ms - _last_drop_ms > 2 * _horizon_ms) {
+        ALOGV("unpredicted drop %d -> %d", max_bandwidth, bandwidth);
+        _stats.missed++;
+        _last_drop_ms = sample->time_ms;
+    }
+}
+
+void LinkPredictor::_reset()
+{
+    _since_seq = _history->get_seq();
+    _count = 0;
+    _degrading = false;
+    _snr_trend.slope = 0;
+    _snr_trend.stddev = 0;
+    _snr_trend.projected = 0;
+    _prediction_ms = 0;
+    _prediction_bandwidth = 0;
+    _prediction_snr = 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdint.h>
+#include "link_history.h"
+
+#define LINK_PREDICTOR_WINDOW 16        // newest samples of the current connection
+
+// least squares trend of one metric over the window
+struct link_trend {
+    float slope;            // units per second
+    float stddev;           // of the residuals around the trend
+    float projected;        // value expected at the end of the horizon
+};
+
+struct link_predictor_stats {
+    uint32_t predictions;
+    uint32_t hits;          // a drop followed within twice the horizon
+    uint32_t false_alarms;
+    uint32_t missed;        // drops that were not predicted
+};
+
+/*
+ * Watches the newest link history samples and predicts a link drop before
+ * it shows up in ul_bandwidth: a falling SNR or RSRP whose projection over
+ * the horizon crosses the low threshold, or an uplink that is saturated
+ * while its rate keeps falling. Each prediction is later scored against what the
+ * link actually did.
+ */
+class LinkPredictor {
+public:
+    LinkPredictor(LinkHistory* history, uint32_t horizon_ms);
+    // call after the sample has been added to the history
+    void update(const d2d_info& info, uint64_t now_ms);
+    bool is_degrading() { return _degrading; }
+    int get_projected_snr() { return (int)_snr_trend.projected; }
+    void get_stats(link_predictor_stats* stats) { *stats = _stats; }
+
+private:
+    bool _get_trend(int field, link_trend* trend);
+    bool _predict();
+    void _score(const link_sample* sample);
+    void _reset();
+
+    LinkHistory* _history;
+    uint32_t _horizon_ms;
+    uint32_t _since_seq;            // first history sample of the current connection
+    int _count;                     // samples in the window
+    bool _degrading;
+    link_trend _snr_trend;
+    uint64_t _prediction_ms;        // open prediction being scored, 0 if none
+    int _prediction_bandwidth;
+    int _prediction_snr;
+    uint64_t _last_drop_ms;
+    link_predictor_stats _stats;
+};
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "link_state.h"
+
+LinkState* LinkState::_instance = nullptr;
+static pthread_mutex_t g_instance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+LinkState::LinkState()
+    : _update_ms(0)
+    , _version(0)
+{
+    pthread_mutex_init(&_lock, NULL);
+    bzero((void*)&_info, sizeof(_info));
+}
+
+// the d2d tracker publishes, the module reactors read
+LinkState* LinkState::get_instance()
+{
+    pthread_mutex_lock(&g_instance_lock);
+    if (_instance == nullptr) {
+        _instance = new LinkState();
+    }
+    pthread_mutex_unlock(&g_instance_lock);
+    return _instance;
+}
+
+void LinkState::publish(const d2d_info& info, uint64_t now_ms)
+{
+    pthread_mutex_lock(&_lock);
+    _info = info;
+    _update_ms = now_ms;
+    _version++;
+    pthread_mutex_unlock(&_lock);
+}
+
+bool LinkState::get(d2d_info* info, uint64_t* update_ms)
+{
+    bool published;
+
+    pthread_mutex_lock(&_lock);
+    published = _version != 0;
+    *info = _info;
+    *update_ms = _update_ms;
+    pthread_mutex_unlock(&_lock);
+    return published;
+}
+
+uint32_t LinkState::get_version()
+{
+    uint32_t version;
+
+    pthread_mutex_lock(&_lock);
+    version = _version;
+    pthread_mutex_unlock(&_lock);
+    return version;
+}
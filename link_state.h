@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include "d2d_info.h"
+
+/*
+ * The combined d2d link state, published by D2dTracker for the other
+ * modules of the process. Readers may run on any thread.
+ */
+class LinkState {
+public:
+    static LinkState* get_instance();
+    void publish(const d2d_info& info, uint64_t now_ms);
+    // false if nothing has been published yet
+    bool get(d2d_info* info, uint64_t* update_ms);
+    // changes on every publish, lets readers skip work on unchanged state
+    uint32_t get_version();
+
+private:
+    LinkState();
+    static LinkState* _instance;
+    pthread_mutex_t _lock;
+    d2d_info _info;
+    uint64_t _update_ms;
+    uint32_t _version;
+};
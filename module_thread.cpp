@@ -26,9 +26,13 @@
 
 #define MSEC_PER_SEC  1000
 #define NSEC_PER_MSEC (1000 * 1000)
+#define NSEC_PER_SEC  (1000LL * 1000 * 1000)
 
 ModuleThread::ModuleThread(const char* name)
-    : _exit(false),
+    : _rx_time_ns(0),
+      _stream_timer_fd(-1),
+      _stream_timer_ms(0),
+      _exit(false),
       _module_name(name)
 {
     _rx_buffer = (uint8_t *) malloc(RX_BUF_SIZE);
@@ -69,27 +73,53 @@ void ModuleThread::_thread_entry()
         for (i = 0; i < r; i++) {
             poll_event_data* d = (poll_event_data*)(events[i].data.ptr);
             ModuleThread* p = static_cast<ModuleThread*>(d->module);
-            if (events[i].events & EPOLLIN) {
+            // fd removed while handling an earlier event of this batch
+            if (d->fd < 0) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
                 p->_handle_read(d->fd, d->type);
             }
         }
+        for (poll_event_data* d : _removed_fd_data) {
+            delete d;
+        }
+        _removed_fd_data.clear();
     }
 }
 
 bool ModuleThread::_add_read_fd(int fd, int type)
 {
     struct epoll_event epev = { };
+    poll_event_data* d = new poll_event_data{this, fd, type};
 
     epev.events = EPOLLIN;
-    epev.data.ptr = new poll_event_data{this, fd, type};
+    epev.data.ptr = d;
 
     if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &epev) < 0) {
         ALOGE("Could not add domain sock fd %d to epoll in %s", fd, _module_name);
+        delete d;
         return false;
     }
+    _fd_data[fd] = d;
     return true;
 }
 
+void ModuleThread::_remove_fd(int fd)
+{
+    std::map<int, poll_event_data*>::iterator it = _fd_data.find(fd);
+
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+        ALOGE("Could not remove fd %d from epoll in %s", fd, _module_name);
+    }
+    if (it != _fd_data.end()) {
+        // events of the current epoll batch may still point to it
+        it->second->fd = -1;
+        _removed_fd_data.push_back(it->second);
+        _fd_data.erase(it);
+    }
+}
+
 bool ModuleThread::_add_timer(int* fd, uint32_t timeout_msec)
 {
     struct itimerspec ts;
@@ -167,41 +197,173 @@ fail:
     return -1;
 }
 
+bool ModuleThread::_enable_rx_timestamp(int fd)
+{
+    int on = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        ALOGE("Could not enable rx timestamp on fd %d in %s, errno %d", fd, _module_name, errno);
+        return false;
+    }
+    return true;
+}
+
 bool ModuleThread::_handle_read(int fd, int type)
 {
     uint64_t val = 0;
     int ret;
+    int i;
+    ssize_t r;
     struct sockaddr_un src_addr;
     socklen_t addrlen;
+    bool result = false;
 
     if(type == TYPE_TIMER_FD) {
         ret = read(fd, &val, sizeof(val));
         if (ret < 1 || val == 0) {
             return false;
         }
+        if (fd == _stream_timer_fd) {
+            _stream_timer_ms = 0;
+            _flush_streams();
+            return true;
+        }
         return _handle_timeout(fd);
     } else if (type == TYPE_DATAGRAM_SOCK_FD) {
-        bzero((void*)&src_addr, sizeof(src_addr));
-        addrlen = sizeof(src_addr);
-        ssize_t r = ::recvfrom(fd, _rx_buffer, RX_BUF_SIZE, 0, (struct sockaddr*)&src_addr, &addrlen);
-
-        if (r == -1) {
-            if(errno != EAGAIN) {
-               ALOGE("_handle_read receive from fd error %d", errno);
+        // drain what is already queued, so that modules can batch their
+        // responses in _process_data_done
+        for (i = 0; i < RX_BATCH_SIZE; i++) {
+            r = _recv_datagram(fd, i == 0 ? 0 : MSG_DONTWAIT, &src_addr, &addrlen);
+            if (r <= 0) {
+                break;
             }
-            return false;
+            result = _process_data(fd, _rx_buffer, r, (struct sockaddr*)&src_addr, addrlen);
         }
-        if (r == 0) {
-            ALOGE("_handle_read receive empty data");
-            return false;
-        }
-        return _process_data(fd, _rx_buffer, r, (struct sockaddr*)&src_addr, addrlen);
+        _process_data_done(fd);
+        return result;
     } else {
         ALOGE("_handle_read should be overriden to read other fd in %s", _module_name);
         return false;
     }
 }
 
+ssize_t ModuleThread::_recv_datagram(int fd, int flags, struct sockaddr_un* src_addr, socklen_t* addrlen)
+{
+    struct iovec iov;
+    struct msghdr hdr;
+    struct cmsghdr* cmsg;
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    timespec ts;
+
+    bzero((void*)src_addr, sizeof(*src_addr));
+    bzero((void*)&hdr, sizeof(hdr));
+    iov.iov_base = _rx_buffer;
+    iov.iov_len = RX_BUF_SIZE;
+    hdr.msg_name = src_addr;
+    hdr.msg_namelen = sizeof(*src_addr);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    ssize_t r = ::recvmsg(fd, &hdr, flags);
+
+    if (r == -1) {
+        if(errno != EAGAIN) {
+           ALOGE("_handle_read receive from fd error %d", errno);
+        }
+        return -1;
+    }
+    if (r == 0) {
+        ALOGE("_handle_read receive empty data");
+        return 0;
+    }
+    // prefer the kernel receive time when SO_TIMESTAMPNS is enabled on fd.
+    // AF_UNIX datagrams carry no arrival stamp, the kernel stamps them as
+    // they are dequeued here, so epoll and scheduling delay are still in it.
+    clock_gettime(CLOCK_REALTIME, &ts);
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            break;
+        }
+    }
+    _rx_time_ns = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+    *addrlen = hdr.msg_namelen;
+    return r;
+}
+
+int ModuleThread::_add_stream(const char* name, uint32_t interval_ms)
+{
+    if (_stream_timer_fd < 0) {
+        _stream_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (_stream_timer_fd < 0) {
+            ALOGE("Unable to create stream timerfd in %s", _module_name);
+            return -1;
+        }
+        if (!_add_read_fd(_stream_timer_fd, TYPE_TIMER_FD)) {
+            ::close(_stream_timer_fd);
+            _stream_timer_fd = -1;
+            return -1;
+        }
+    }
+    return _scheduler.add_stream(name, interval_ms);
+}
+
+void ModuleThread::_update_stream(int stream)
+{
+    if (stream < 0) {
+        return;
+    }
+    if (_scheduler.update(stream, _get_monotonic_ms())) {
+        _flush_streams();
+    } else {
+        _arm_stream_timer();
+    }
+}
+
+void ModuleThread::_send_stream(int stream)
+{
+    (void) stream;
+}
+
+void ModuleThread::_flush_streams()
+{
+    int streams[RATE_SCHEDULER_MAX_STREAMS];
+    int n;
+    int i;
+
+    n = _scheduler.take_due(_get_monotonic_ms(), streams, RATE_SCHEDULER_MAX_STREAMS);
+    for (i = 0; i < n; i++) {
+        _send_stream(streams[i]);
+    }
+    _arm_stream_timer();
+}
+
+// The deadlines are absolute, so every stream due at the same grid point
+// is sent from a single wakeup.
+void ModuleThread::_arm_stream_timer()
+{
+    struct itimerspec ts = { };
+    uint64_t deadline;
+
+    if (!_scheduler.next_deadline(&deadline)) {
+        deadline = 0;
+    } else if (deadline == 0) {
+        // never sent before, a zero it_value would disarm
+        deadline = 1;
+    }
+    if (deadline == _stream_timer_ms) {
+        return;
+    }
+    ts.it_value.tv_sec = deadline / MSEC_PER_SEC;
+    ts.it_value.tv_nsec = (deadline % MSEC_PER_SEC) * NSEC_PER_MSEC;
+    if (timerfd_settime(_stream_timer_fd, TFD_TIMER_ABSTIME, &ts, NULL) < 0) {
+        ALOGE("Unable to arm stream timer in %s", _module_name);
+        return;
+    }
+    _stream_timer_ms = deadline;
+}
+
 bool ModuleThread::_handle_timeout(int fd)
 {
     (void) fd;
@@ -219,6 +381,11 @@ bool ModuleThread::_process_data(int fd, uint8_t* buf, int len,
     return true;
 }
 
+void ModuleThread::_process_data_done(int fd)
+{
+    (void) fd;
+}
+
 bool ModuleThread::_parse_mavlink_pack(uint8_t* buffer, uint32_t len, mavlink_message_t* msg)
 {
     uint32_t i;
@@ -254,20 +421,68 @@ bool ModuleThread::_send_message(int fd, const void *buf, size_t len,
     struct sockaddr_un sockaddr;
     socklen_t sockaddr_len;
 
+    if (!_get_server_addr(server_name, server_type, &sockaddr, &sockaddr_len)) {
+        return false;
+    }
+    return _send_message(fd, buf, len, (const struct sockaddr*)&sockaddr, sockaddr_len);
+}
+
+bool ModuleThread::_send_messages(int fd, uint8_t* const* bufs, const size_t* lens, int count,
+                                  const char* server_name, int server_type)
+{
+    struct sockaddr_un sockaddr;
+    socklen_t sockaddr_len;
+    struct mmsghdr msgs[TX_BATCH_SIZE];
+    struct iovec iovs[TX_BATCH_SIZE];
+    int i;
+    int sent = 0;
+    int r;
+
+    if (count > TX_BATCH_SIZE) {
+        ALOGE("send batch of %d exceeds %d in %s", count, TX_BATCH_SIZE, _module_name);
+        return false;
+    }
+    if (!_get_server_addr(server_name, server_type, &sockaddr, &sockaddr_len)) {
+        return false;
+    }
+    bzero((void*)msgs, sizeof(msgs));
+    for (i = 0; i < count; i++) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = lens[i];
+        msgs[i].msg_hdr.msg_name = &sockaddr;
+        msgs[i].msg_hdr.msg_namelen = sockaddr_len;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (sent < count) {
+        r = ::sendmmsg(fd, msgs + sent, count - sent, 0);
+        if (r <= 0) {
+            ALOGE("send batch [%d] failed in %s errno %d, %d of %d sent",
+                  fd, _module_name, errno, sent, count);
+            return false;
+        }
+        sent += r;
+    }
+    ALOGV("sent %d messages to [%d] in %s", count, fd, _module_name);
+    return true;
+}
+
+bool ModuleThread::_get_server_addr(const char* server_name, int server_type,
+                                    struct sockaddr_un* sockaddr, socklen_t* sockaddr_len)
+{
     if (server_name == nullptr) {
         ALOGE("server is null!");
         return false;
     }
-    bzero((void*)&sockaddr, sizeof(sockaddr));
-    sockaddr.sun_family = AF_UNIX;
+    bzero((void*)sockaddr, sizeof(*sockaddr));
+    sockaddr->sun_family = AF_UNIX;
     if(server_type == TYPE_DOMAIN_SOCK_ABSTRACT) {
-        sockaddr.sun_path[0] = 0;
-        strcpy(sockaddr.sun_path+1, server_name);
-        sockaddr_len = strlen(server_name) + offsetof(struct sockaddr_un, sun_path) + 1;
+        sockaddr->sun_path[0] = 0;
+        strcpy(sockaddr->sun_path+1, server_name);
+        *sockaddr_len = strlen(server_name) + offsetof(struct sockaddr_un, sun_path) + 1;
     } else {
-        strcpy(sockaddr.sun_path, server_name);
-        sockaddr_len = sizeof(sockaddr);
+        strcpy(sockaddr->sun_path, server_name);
+        *sockaddr_len = sizeof(*sockaddr);
     }
-
-    return _send_message(fd, buf, len, (const struct sockaddr*)&sockaddr, sockaddr_len);
+    return true;
 }
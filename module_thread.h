@@ -17,12 +17,18 @@
 #pragma once
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <sys/un.h>
 #include <errno.h>
+#include <map>
+#include <vector>
 #include <mavlink.h>
 #include "thread_base.h"
+#include "rate_scheduler.h"
 
 #define RX_BUF_SIZE 1024
+#define RX_BATCH_SIZE 16    // datagrams drained per wakeup
+#define TX_BATCH_SIZE 16    // datagrams per _send_messages call
 
 enum {
     TYPE_DOMAIN_SOCK,
@@ -32,6 +38,7 @@ enum {
 enum {
     TYPE_DATAGRAM_SOCK_FD,
     TYPE_TIMER_FD,
+    TYPE_STREAM_SOCK_FD,
     TYPE_OTHER_FD
 };
 
@@ -62,21 +69,42 @@ public:
 protected:
     virtual void _thread_entry() override;
     bool _add_read_fd(int fd, int type);
+    void _remove_fd(int fd);
     bool _add_timer(int* fd, uint32_t timeout_msec);
     int _get_domain_socket(const char* sock_name, int type, bool non_block = true);
+    bool _enable_rx_timestamp(int fd);
+    int64_t _get_rx_time_ns() { return _rx_time_ns; }
     virtual bool _handle_read(int fd, int type);
     virtual bool _handle_timeout(int fd);
     virtual bool _process_data(int fd, uint8_t* buf, int len,
                               struct sockaddr* src_addr, int addrlen);
+    virtual void _process_data_done(int fd);
     bool _parse_mavlink_pack(uint8_t* buffer, uint32_t len, mavlink_message_t* msg);
     bool _send_message(int fd, const void *buf, size_t len,
                        const struct sockaddr *dest_addr, socklen_t addrlen);
     bool _send_message(int fd, const void *buf, size_t len,
                        const char* server_name, int server_type);
+    bool _send_messages(int fd, uint8_t* const* bufs, const size_t* lens, int count,
+                        const char* server_name, int server_type);
+    // rate limited outbound streams, see RateScheduler
+    int _add_stream(const char* name, uint32_t interval_ms);
+    void _update_stream(int stream);
+    virtual void _send_stream(int stream);
 
 private:
+    ssize_t _recv_datagram(int fd, int flags, struct sockaddr_un* src_addr, socklen_t* addrlen);
+    bool _get_server_addr(const char* server_name, int server_type,
+                          struct sockaddr_un* sockaddr, socklen_t* sockaddr_len);
+    void _flush_streams();
+    void _arm_stream_timer();
     uint8_t* _rx_buffer;
+    int64_t _rx_time_ns;
     int _epoll_fd;
+    std::map<int, poll_event_data*> _fd_data;
+    std::vector<poll_event_data*> _removed_fd_data;
+    RateScheduler _scheduler;
+    int _stream_timer_fd;
+    uint64_t _stream_timer_ms;          // deadline the timer is armed for, 0 if disarmed
     bool _exit;
     const char* _module_name;
 };
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <utils/Log.h>
+
+#include "rate_scheduler.h"
+
+#undef LOG_TAG
+#define LOG_TAG "RateScheduler"
+
+RateScheduler::RateScheduler()
+    : _count(0)
+{
+    bzero((void*)_streams, sizeof(_streams));
+}
+
+int RateScheduler::add_stream(const char* name, uint32_t interval_ms)
+{
+    rate_stream* s;
+
+    if (_count == RATE_SCHEDULER_MAX_STREAMS) {
+        ALOGE("no room for stream %s", name);
+        return -1;
+    }
+    s = &_streams[_count];
+    s->name = name;
+    s->interval_ms = interval_ms;
+    ALOGD("stream %s every %u ms", name, interval_ms);
+    return _count++;
+}
+
+bool RateScheduler::update(int stream, uint64_t now_ms)
+{
+    rate_stream* s = &_streams[stream];
+
+    s->pending = true;
+    s->updates++;
+    return now_ms >= s->next_ms;
+}
+
+int RateScheduler::take_due(uint64_t now_ms, int* streams, int max)
+{
+    rate_stream* s;
+    uint64_t next;
+    int n = 0;
+    int i;
+
+    for (i = 0; i < _count && n < max; i++) {
+        s = &_streams[i];
+        if (!s->pending || now_ms < s->next_ms) {
+            continue;
+        }
+        s->pending = false;
+        s->sent++;
+        // rounding up keeps the rate at or below the configured one
+        next = now_ms + s->interval_ms;
+        s->next_ms = (s->interval_ms == 0) ? 0 :
+                     (next + RATE_SCHEDULER_ALIGN_MS - 1) / RATE_SCHEDULER_ALIGN_MS * RATE_SCHEDULER_ALIGN_MS;
+        streams[n++] = i;
+    }
+    return n;
+}
+
+bool RateScheduler::next_deadline(uint64_t* deadline_ms)
+{
+    bool found = false;
+    int i;
+
+    for (i = 0; i < _count; i++) {
+        if (_streams[i].pending && (!found || _streams[i].next_ms < *deadline_ms)) {
+            *deadline_ms = _streams[i].next_ms;
+            found = true;
+        }
+    }
+    return found;
+}
+
+const rate_stream* RateScheduler::get_stream(int stream)
+{
+    return &_streams[stream];
+}
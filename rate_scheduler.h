@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdint.h>
+
+#define RATE_SCHEDULER_MAX_STREAMS  8
+#define RATE_SCHEDULER_ALIGN_MS     50      // deadlines fall on this grid
+
+struct rate_stream {
+    const char* name;
+    uint32_t interval_ms;           // 0 sends every update at once
+    bool pending;                   // updated since the last send
+    uint64_t next_ms;               // earliest time of the next send
+    uint32_t updates;
+    uint32_t sent;
+};
+
+/*
+ * Paces outbound streams to their configured rate. An update only marks
+ * the stream pending, the sender builds the message from its latest state
+ * when the stream is due, so updates between two sends are coalesced.
+ * A stream idle for a full interval is due at once; a busy one is due on
+ * a RATE_SCHEDULER_ALIGN_MS grid, so streams with related intervals share
+ * their wakeups. Only bookkeeping lives here, ModuleThread drives it from
+ * a timerfd.
+ */
+class RateScheduler {
+public:
+    RateScheduler();
+    // returns the stream id, -1 when there is no room left
+    int add_stream(const char* name, uint32_t interval_ms);
+    // returns true if the stream is due right away
+    bool update(int stream, uint64_t now_ms);
+    // fills the due streams and starts their next interval
+    int take_due(uint64_t now_ms, int* streams, int max);
+    // earliest deadline of the pending streams, false if none is pending
+    bool next_deadline(uint64_t* deadline_ms);
+    const rate_stream* get_stream(int stream);
+
+private:
+    rate_stream _streams[RATE_SCHEDULER_MAX_STREAMS];
+    int _count;
+};
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <utils/Log.h>
+
+#include "config.h"
+#include "link_state.h"
+#include "telemetry_budget.h"
+
+#undef LOG_TAG
+#define LOG_TAG "TelemetryBudget"
+
+#define LINK_STATE_TIMEOUT_MS   10000   // older link state is as good as none
+
+enum {
+    LINK_MODE_UNKNOWN = 0,              // no budget, every producer at its cadence
+    LINK_MODE_DOWN,                     // every producer at its minimum rate
+    LINK_MODE_LIMITED,
+};
+
+// rates are in bytes per 1000 seconds to stay in integers
+static uint64_t get_rate(uint32_t bytes, uint32_t interval_ms)
+{
+    return (uint64_t)bytes * 1000 * 1000 / interval_ms;
+}
+
+TelemetryBudget* TelemetryBudget::_instance = nullptr;
+static pthread_mutex_t g_instance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+TelemetryBudget::TelemetryBudget()
+    : _count(0)
+    , _link_version(0)
+    , _link_mode(LINK_MODE_UNKNOWN)
+{
+    pthread_mutex_init(&_lock, NULL);
+    bzero((void*)_producers, sizeof(_producers));
+    _fraction = Config::get_instance()->get_telemetry_budget_fraction();
+}
+
+// producers on the board, camera and d2d threads all get here
+TelemetryBudget* TelemetryBudget::get_instance()
+{
+    pthread_mutex_lock(&g_instance_lock);
+    if (_instance == nullptr) {
+        _instance = new TelemetryBudget();
+    }
+    pthread_mutex_unlock(&g_instance_lock);
+    return _instance;
+}
+
+int TelemetryBudget::add_producer(const char* name, int priority, uint32_t bytes,
+                                  uint32_t nominal_interval_ms, uint32_t max_interval_ms)
+{
+    telemetry_producer* p;
+    int id;
+
+    pthread_mutex_lock(&_lock);
+    if (_count == TELEMETRY_MAX_PRODUCERS || nominal_interval_ms == 0) {
+        pthread_mutex_unlock(&_lock);
+        ALOGE("can not add telemetry producer %s", name);
+        return -1;
+    }
+    id = _count++;
+    p = &_producers[id];
+    p->name = name;
+    p->priority = priority;
+    p->bytes = bytes;
+    p->nominal_interval_ms = nominal_interval_ms;
+    p->max_interval_ms = (max_interval_ms > nominal_interval_ms) ? max_interval_ms : nominal_interval_ms;
+    p->interval_ms = nominal_interval_ms;
+    // force a new allocation including this producer
+    _link_version = 0;
+    _link_mode = LINK_MODE_UNKNOWN;
+    pthread_mutex_unlock(&_lock);
+    return id;
+}
+
+bool TelemetryBudget::allow(int producer, uint64_t now_ms)
+{
+    telemetry_producer* p;
+
+    if (producer < 0) {
+        return true;
+    }
+    pthread_mutex_lock(&_lock);
+    _refresh(now_ms);
+    p = &_producers[producer];
+    // producers tick at their own cadence with some jitter, half a tick of
+    // slack keeps an unthrottled producer from losing ticks
+    if (p->last_ms != 0 && now_ms - p->last_ms + p->nominal_interval_ms / 2 < p->interval_ms) {
+        p->skipped++;
+        pthread_mutex_unlock(&_lock);
+        ALOGV("skip %s, %u ms granted", p->name, p->interval_ms);
+        return false;
+    }
+    p->last_ms = now_ms;
+    pthread_mutex_unlock(&_lock);
+    return true;
+}
+
+void TelemetryBudget::_refresh(uint64_t now_ms)
+{
+    d2d_info info;
+    uint64_t update_ms;
+    uint32_t version = LinkState::get_instance()->get_version();
+    int mode;
+    int i;
+
+    // a link state that stops changing still goes stale
+    if (!LinkState::get_instance()->get(&info, &update_ms) ||
+        now_ms - update_ms > LINK_STATE_TIMEOUT_MS) {
+        mode = LINK_MODE_UNKNOWN;
+    } else if (info.service_status != CONNECTED) {
+        mode = LINK_MODE_DOWN;
+    } else {
+        mode = LINK_MODE_LIMITED;
+    }
+    if (mode == _link_mode && version == _link_version) {
+        return;
+    }
+    if (mode != _link_mode) {
+        ALOGD("telemetry budget mode %d -> %d", _link_mode, mode);
+    }
+    _link_mode = mode;
+    _link_version = version;
+
+    for (i = 0; i < _count; i++) {
+        _producers[i].interval_ms = (mode == LINK_MODE_DOWN) ? _producers[i].max_interval_ms :
+                                                               _producers[i].nominal_interval_ms;
+    }
+    if (mode == LINK_MODE_LIMITED) {
+        // kbps to bytes per 1000 seconds
+        _allocate((uint64_t)(info.ul_bandwidth > 0 ? info.ul_bandwidth : 0) * 1000 / 8 *
+                  _fraction / 100 * 1000);
+    }
+}
+
+void TelemetryBudget::_allocate(uint64_t budget)
+{
+    telemetry_producer* p;
+    uint64_t used = 0;
+    uint64_t base;
+    uint64_t extra;
+    int priority;
+    int i;
+
+    for (i = 0; i < _count; i++) {
+        used += get_rate(_producers[i].bytes, _producers[i].max_interval_ms);
+        _producers[i].interval_ms = _producers[i].max_interval_ms;
+    }
+    for (priority = TELEMETRY_PRIORITY_HIGH; priority < TELEMETRY_PRIORITY_MAX; priority++) {
+        for (i = 0; i < _count && used < budget; i++) {
+            p = &_producers[i];
+            if (p->priority != priority) {
+                continue;
+            }
+            base = get_rate(p->bytes, p->max_interval_ms);
+            extra = get_rate(p->bytes, p->nominal_interval_ms) - base;
+            if (used + extra <= budget) {
+                p->interval_ms = p->nominal_interval_ms;
+                used += extra;
+            } else {
+                p->interval_ms = (uint64_t)p->bytes * 1000 * 1000 / (base + budget - used);
+                used = budget;
+            }
+        }
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+
+#define TELEMETRY_MAX_PRODUCERS 8
+
+enum {
+    TELEMETRY_PRIORITY_HIGH = 0,
+    TELEMETRY_PRIORITY_MEDIUM,
+    TELEMETRY_PRIORITY_LOW,
+    TELEMETRY_PRIORITY_MAX
+};
+
+struct telemetry_producer {
+    const char* name;
+    int priority;
+    uint32_t bytes;                 // per message
+    uint32_t nominal_interval_ms;   // the producer's own cadence
+    uint32_t max_interval_ms;       // minimum rate, kept even over budget
+    uint32_t interval_ms;           // currently granted
+    uint64_t last_ms;               // last allowed message
+    uint32_t skipped;
+};
+
+/*
+ * Shares a fraction of the granted d2d uplink between the telemetry the
+ * daemon sends itself. Every producer keeps its minimum rate; what is left
+ * of the budget raises producers towards their own cadence in priority
+ * order. Without a recent link state the budget is unlimited.
+ *
+ * Producers call allow() on each of their ticks and skip the message when
+ * it returns false. Replies to commands, such as COMMAND_ACK and TIMESYNC
+ * answers, do not go through the budget. Safe to use from any thread.
+ */
+class TelemetryBudget {
+public:
+    static TelemetryBudget* get_instance();
+    // returns the producer id, -1 when there is no room left
+    int add_producer(const char* name, int priority, uint32_t bytes,
+                     uint32_t nominal_interval_ms, uint32_t max_interval_ms);
+    bool allow(int producer, uint64_t now_ms);
+
+private:
+    TelemetryBudget();
+    void _refresh(uint64_t now_ms);
+    void _allocate(uint64_t budget);    // in bytes per 1000 s, as the rates
+    static TelemetryBudget* _instance;
+    pthread_mutex_t _lock;
+    telemetry_producer _producers[TELEMETRY_MAX_PRODUCERS];
+    int _count;
+    int _fraction;                  // percent of ul_bandwidth
+    uint32_t _link_version;         // LinkState the allocation was made for
+    int _link_mode;
+};
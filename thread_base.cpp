@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <time.h>
 #include "thread_base.h"
 
 bool ThreadBase::start_thread()
@@ -26,6 +27,14 @@ void ThreadBase::wait_exit()
     (void) pthread_join(_thread, NULL);
 }
 
+uint64_t ThreadBase::_get_monotonic_ms()
+{
+    timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void* ThreadBase:: _thread_entry_func(void *arg)
 {
     ((ThreadBase *)arg)->_thread_entry();
@@ -16,6 +16,7 @@
 
 #pragma once
 #include "pthread.h"
+#include <stdint.h>
 
 class ThreadBase {
 public:
@@ -25,6 +26,10 @@ public:
     void wait_exit();
     virtual void _thread_entry() = 0;
 
+protected:
+    // CLOCK_MONOTONIC in ms, the time base of the module threads
+    static uint64_t _get_monotonic_ms();
+
 private:
     static void * _thread_entry_func(void *arg);
     pthread_t _thread;
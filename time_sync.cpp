@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/timex.h>
+#include <utils/Log.h>
+
+#include "time_sync.h"
+
+#undef LOG_TAG
+#define LOG_TAG "TimeSync"
+
+#define NSEC_PER_SEC                (1000LL * 1000 * 1000)
+#define NSEC_PER_USEC               1000LL
+#define NSEC_PER_MSEC               (1000LL * 1000)
+
+#define TIME_SYNC_MIN_INTERVAL_MS   500
+#define TIME_SYNC_MAX_INTERVAL_MS   16000
+#define TIME_SYNC_SAMPLES           5       // exchanges per estimate
+#define TIME_SYNC_MAX_RTT_NS        (1000 * NSEC_PER_MSEC)
+#define TIME_SYNC_RTT_SLACK_NS      (1 * NSEC_PER_MSEC)
+#define TIME_SYNC_CONVERGED_NS      (1 * NSEC_PER_MSEC)
+#define TIME_SYNC_DIVERGED_NS       (10 * NSEC_PER_MSEC)
+#define TIME_SYNC_STEP_NS           (500 * NSEC_PER_MSEC)
+
+TimeSync::TimeSync()
+    : _sample_count(0)
+    , _interval_ms(TIME_SYNC_MIN_INTERVAL_MS)
+    , _last_request_ms(0)
+{
+    bzero((void*)_pending, sizeof(_pending));
+    bzero((void*)_samples, sizeof(_samples));
+}
+
+int64_t TimeSync::get_time_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+bool TimeSync::request_due(uint64_t now_ms)
+{
+    if (_last_request_ms != 0 && now_ms - _last_request_ms < _interval_ms) {
+        return false;
+    }
+    _last_request_ms = now_ms;
+    return true;
+}
+
+int64_t TimeSync::make_request()
+{
+    int i;
+    int oldest = 0;
+    int64_t ts1 = get_time_ns();
+
+    // replace a free slot, or the oldest outstanding request
+    for (i = 0; i < TIME_SYNC_MAX_PENDING; i++) {
+        if (_pending[i] < _pending[oldest]) {
+            oldest = i;
+        }
+    }
+    _pending[oldest] = ts1;
+    return ts1;
+}
+
+bool TimeSync::handle_response(int64_t tc1, int64_t ts1, int64_t rx_ns)
+{
+    int64_t rtt;
+    int64_t offset;
+
+    if (!_take_pending(ts1)) {
+        ALOGV("ignore time sync response not matching a request %lld", (long long)ts1);
+        return false;
+    }
+    rtt = rx_ns - ts1;
+    if (rtt < 0 || rtt > TIME_SYNC_MAX_RTT_NS) {
+        ALOGD("drop time sync sample with rtt %lld ns", (long long)rtt);
+        return true;
+    }
+    _samples[_sample_count].offset_ns = tc1 - ts1 - rtt / 2;
+    _samples[_sample_count].rtt_ns = rtt;
+    if (++_sample_count < TIME_SYNC_SAMPLES) {
+        return true;
+    }
+
+    if (_estimate(&offset, &rtt)) {
+        ALOGV("time sync offset %lld ns, rtt %lld ns", (long long)offset, (long long)rtt);
+        _apply_offset(offset);
+        if (llabs(offset) <= TIME_SYNC_CONVERGED_NS) {
+            if (_interval_ms < TIME_SYNC_MAX_INTERVAL_MS) {
+                _interval_ms *= 2;
+            }
+        } else if (llabs(offset) > TIME_SYNC_DIVERGED_NS) {
+            _interval_ms = TIME_SYNC_MIN_INTERVAL_MS;
+        }
+    }
+    _reset_samples();
+    return true;
+}
+
+bool TimeSync::_take_pending(int64_t ts1)
+{
+    int i;
+
+    if (ts1 <= 0) {
+        return false;
+    }
+    for (i = 0; i < TIME_SYNC_MAX_PENDING; i++) {
+        if (_pending[i] == ts1) {
+            _pending[i] = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TimeSync::_estimate(int64_t* offset_ns, int64_t* rtt_ns)
+{
+    int64_t accepted[TIME_SYNC_MAX_SAMPLES];
+    int64_t min_rtt;
+    int64_t limit;
+    int64_t v;
+    int n = 0;
+    int i, j;
+
+    if (_sample_count == 0) {
+        return false;
+    }
+    min_rtt = _samples[0].rtt_ns;
+    for (i = 1; i < _sample_count; i++) {
+        if (_samples[i].rtt_ns < min_rtt) {
+            min_rtt = _samples[i].rtt_ns;
+        }
+    }
+
+    // samples delayed well beyond the fastest exchange carry asymmetric
+    // queueing delay, keep the others and take their median offset
+    limit = min_rtt * 2 + TIME_SYNC_RTT_SLACK_NS;
+    for (i = 0; i < _sample_count; i++) {
+        if (_samples[i].rtt_ns > limit) {
+            continue;
+        }
+        v = _samples[i].offset_ns;
+        for (j = n; j > 0 && accepted[j - 1] > v; j--) {
+            accepted[j] = accepted[j - 1];
+        }
+        accepted[j] = v;
+        n++;
+    }
+    *offset_ns = accepted[n / 2];
+    *rtt_ns = min_rtt;
+    return true;
+}
+
+void TimeSync::_apply_offset(int64_t offset_ns)
+{
+    if (llabs(offset_ns) >= TIME_SYNC_STEP_NS) {
+        timespec ts;
+        int64_t now = get_time_ns() + offset_ns;
+        ts.tv_sec = now / NSEC_PER_SEC;
+        ts.tv_nsec = now % NSEC_PER_SEC;
+        ALOGD("step time by %lld ms", (long long)(offset_ns / NSEC_PER_MSEC));
+        if (clock_settime(CLOCK_REALTIME, &ts) != 0) {
+            ALOGE("failed to set time! %d", errno);
+        }
+        // outstanding requests were stamped in the old time base
+        bzero((void*)_pending, sizeof(_pending));
+    } else {
+        struct timex tx;
+        bzero((void*)&tx, sizeof(tx));
+        tx.modes = ADJ_OFFSET_SINGLESHOT;
+        tx.offset = offset_ns / NSEC_PER_USEC;
+        ALOGV("slew time by %ld us", (long)tx.offset);
+        if (adjtimex(&tx) < 0) {
+            ALOGE("failed to adjtimex! %d", errno);
+        }
+    }
+}
+
+void TimeSync::_reset_samples()
+{
+    _sample_count = 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdint.h>
+
+#define TIME_SYNC_MAX_SAMPLES 8
+#define TIME_SYNC_MAX_PENDING 4
+
+struct time_sync_sample {
+    int64_t offset_ns;      // remote clock minus local clock
+    int64_t rtt_ns;
+};
+
+/*
+ * Time sync client following the MAVLink TIMESYNC protocol: requests carry
+ * tc1 = 0 and ts1 = local time in ns, the server answers with tc1 = its own
+ * time and echoes ts1. Offsets are estimated over several exchanges, slewed
+ * with adjtimex and only stepped when the error is too large to slew.
+ */
+class TimeSync {
+public:
+    TimeSync();
+    bool request_due(uint64_t now_ms);
+    int64_t make_request();
+    // false if the response answers none of our requests
+    bool handle_response(int64_t tc1, int64_t ts1, int64_t rx_ns);
+    static int64_t get_time_ns();
+
+private:
+    bool _take_pending(int64_t ts1);
+    bool _estimate(int64_t* offset_ns, int64_t* rtt_ns);
+    void _apply_offset(int64_t offset_ns);
+    void _reset_samples();
+
+    int64_t _pending[TIME_SYNC_MAX_PENDING];
+    time_sync_sample _samples[TIME_SYNC_MAX_SAMPLES];
+    int _sample_count;
+    uint32_t _interval_ms;
+    uint64_t _last_request_ms;
+};
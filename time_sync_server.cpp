@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <utils/Log.h>
+
+#include "time_sync_server.h"
+
+#undef LOG_TAG
+#define LOG_TAG "TimeSyncServer"
+
+#define TIME_SYNC_PROBE_INTERVAL_MS 2000
+#define TIME_SYNC_MAX_RTT_NS        (1000LL * 1000 * 1000)
+#define TIME_SYNC_TOKEN_SCALE       1000
+#define TIME_SYNC_BURST             4       // requests a client may send back to back
+#define TIME_SYNC_EWMA_SHIFT        3       // smoothing factor 1/8
+
+TimeSyncServer::TimeSyncServer()
+    : _rate(1)
+    , _last_probe_ms(0)
+{
+    bzero((void*)_clients, sizeof(_clients));
+    bzero((void*)_probes, sizeof(_probes));
+}
+
+void TimeSyncServer::set_client_rate(int requests_per_sec)
+{
+    _rate = requests_per_sec > 0 ? requests_per_sec : 1;
+}
+
+bool TimeSyncServer::accept_request(uint8_t sysid, uint64_t now_ms)
+{
+    time_sync_client* client = _get_client(sysid, now_ms);
+    uint32_t max_tokens = TIME_SYNC_BURST * TIME_SYNC_TOKEN_SCALE;
+    uint64_t refill;
+
+    refill = (now_ms - client->last_refill_ms) * _rate * TIME_SYNC_TOKEN_SCALE / 1000;
+    if (refill > 0) {
+        client->tokens = (client->tokens + refill > max_tokens) ?
+                         max_tokens : client->tokens + refill;
+        client->last_refill_ms = now_ms;
+    }
+    client->requests++;
+    if (client->tokens < TIME_SYNC_TOKEN_SCALE) {
+        client->dropped++;
+        ALOGV("drop time sync request from %d, over rate", sysid);
+        return false;
+    }
+    client->tokens -= TIME_SYNC_TOKEN_SCALE;
+    return true;
+}
+
+bool TimeSyncServer::probe_due(uint64_t now_ms)
+{
+    if (_last_probe_ms != 0 && now_ms - _last_probe_ms < TIME_SYNC_PROBE_INTERVAL_MS) {
+        return false;
+    }
+    _last_probe_ms = now_ms;
+    return true;
+}
+
+int64_t TimeSyncServer::make_probe()
+{
+    int i;
+    int oldest = 0;
+    int64_t ts1 = TimeSync::get_time_ns();
+
+    for (i = 0; i < TIME_SYNC_MAX_PENDING; i++) {
+        if (_probes[i] < _probes[oldest]) {
+            oldest = i;
+        }
+    }
+    _probes[oldest] = ts1;
+    return ts1;
+}
+
+void TimeSyncServer::handle_probe_response(uint8_t sysid, int64_t tc1, int64_t ts1,
+                                           int64_t rx_ns, uint64_t now_ms)
+{
+    time_sync_client* client;
+    int64_t rtt;
+    int64_t offset;
+
+    // every client answers the same probe, so keep it until it expires
+    if (!_match_probe(ts1)) {
+        return;
+    }
+    rtt = rx_ns - ts1;
+    if (rtt < 0 || rtt > TIME_SYNC_MAX_RTT_NS) {
+        return;
+    }
+    offset = tc1 - ts1 - rtt / 2;
+    client = _get_client(sysid, now_ms);
+    if (client->probes == 0) {
+        client->offset_ns = offset;
+        client->rtt_ns = rtt;
+        client->min_rtt_ns = rtt;
+        client->max_rtt_ns = rtt;
+    } else {
+        client->offset_ns += (offset - client->offset_ns) >> TIME_SYNC_EWMA_SHIFT;
+        client->rtt_ns += (rtt - client->rtt_ns) >> TIME_SYNC_EWMA_SHIFT;
+        if (rtt < client->min_rtt_ns) {
+            client->min_rtt_ns = rtt;
+        }
+        if (rtt > client->max_rtt_ns) {
+            client->max_rtt_ns = rtt;
+        }
+    }
+    client->probes++;
+}
+
+void TimeSyncServer::dump_stats()
+{
+    int i;
+
+    for (i = 0; i < TIME_SYNC_MAX_CLIENTS; i++) {
+        time_sync_client* c = &_clients[i];
+        if (!c->used) {
+            continue;
+        }
+        ALOGI("client %d: requests %u dropped %u probes %u offset %lld us "
+              "rtt %lld us (min %lld max %lld)",
+              c->sysid, c->requests, c->dropped, c->probes,
+              (long long)(c->offset_ns / 1000), (long long)(c->rtt_ns / 1000),
+              (long long)(c->min_rtt_ns / 1000), (long long)(c->max_rtt_ns / 1000));
+    }
+}
+
+time_sync_client* TimeSyncServer::_get_client(uint8_t sysid, uint64_t now_ms)
+{
+    uint32_t mask = TIME_SYNC_MAX_CLIENTS - 1;
+    // multiplicative hash, the top bits index the table
+    uint32_t slot = (sysid * 2654435761u) >> (32 - TIME_SYNC_CLIENT_BITS);
+    time_sync_client* stale = nullptr;
+    time_sync_client* c;
+    uint32_t i;
+
+    // linear probing, slots are never emptied again so a lookup can stop
+    // at the first unused slot
+    for (i = 0; i < TIME_SYNC_MAX_CLIENTS; i++) {
+        c = &_clients[(slot + i) & mask];
+        if (!c->used) {
+            break;
+        }
+        if (c->sysid == sysid) {
+            c->last_seen_ms = now_ms;
+            return c;
+        }
+        if (stale == nullptr || c->last_seen_ms < stale->last_seen_ms) {
+            stale = c;
+        }
+    }
+    if (i == TIME_SYNC_MAX_CLIENTS) {
+        // table full, reuse the client that has been silent the longest
+        ALOGD("evict time sync client %d for %d", stale->sysid, sysid);
+        c = stale;
+    }
+    bzero((void*)c, sizeof(*c));
+    c->used = true;
+    c->sysid = sysid;
+    c->last_seen_ms = now_ms;
+    c->last_refill_ms = now_ms;
+    c->tokens = TIME_SYNC_BURST * TIME_SYNC_TOKEN_SCALE;
+    return c;
+}
+
+bool TimeSyncServer::_match_probe(int64_t ts1)
+{
+    int i;
+
+    if (ts1 <= 0) {
+        return false;
+    }
+    for (i = 0; i < TIME_SYNC_MAX_PENDING; i++) {
+        if (_probes[i] == ts1) {
+            return true;
+        }
+    }
+    return false;
+}
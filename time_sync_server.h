@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include <stdint.h>
+#include "time_sync.h"
+
+#define TIME_SYNC_CLIENT_BITS 4
+#define TIME_SYNC_MAX_CLIENTS (1 << TIME_SYNC_CLIENT_BITS)
+
+struct time_sync_client {
+    bool used;
+    uint8_t sysid;
+    uint64_t last_seen_ms;
+    uint64_t last_refill_ms;
+    uint32_t tokens;                // in 1/1000 of a request
+    uint32_t requests;
+    uint32_t dropped;
+    uint32_t probes;                // answered probes
+    int64_t offset_ns;              // client clock minus server clock, smoothed
+    int64_t rtt_ns;                 // smoothed
+    int64_t min_rtt_ns;
+    int64_t max_rtt_ns;
+};
+
+/*
+ * Ground side time server state. Clients are tracked by sysid in a small
+ * open addressing table; each one is rate limited with a token bucket.
+ * The server also sends its own TIMESYNC probes, the replies give the
+ * per-client offset and RTT statistics.
+ */
+class TimeSyncServer {
+public:
+    TimeSyncServer();
+    void set_client_rate(int requests_per_sec);
+    bool accept_request(uint8_t sysid, uint64_t now_ms);
+    bool probe_due(uint64_t now_ms);
+    int64_t make_probe();
+    void handle_probe_response(uint8_t sysid, int64_t tc1, int64_t ts1,
+                               int64_t rx_ns, uint64_t now_ms);
+    void dump_stats();
+
+private:
+    time_sync_client* _get_client(uint8_t sysid, uint64_t now_ms);
+    bool _match_probe(int64_t ts1);
+
+    time_sync_client _clients[TIME_SYNC_MAX_CLIENTS];
+    int64_t _probes[TIME_SYNC_MAX_PENDING];
+    uint32_t _rate;
+    uint64_t _last_probe_ms;
+};
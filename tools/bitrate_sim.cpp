@@ -0,0 +1,489 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays recorded d2d traces through the bitrate controllers on the host,
+ * with a simple encoder and uplink model, so controller settings can be
+ * compared without flying. A trace is a csv file with one d2d update per
+ * line:
+ *
+ *     t_ms,srv_stat,rsrp,ul_bw,ul_rate,snr
+ *
+ * srv_stat is 1 when connected, as in the SRV_STAT message. Lines starting
+ * with '#' and a header line are skipped.
+ *
+ * The encoder follows its target with a first order lag and pauses in the
+ * dummy state, an idr adds one oversized frame. The uplink drains the
+ * encoder output at the recorded ul_bw; video queued for longer than the
+ * stall threshold counts as stalled, and the queue is cut at its limit.
+ * The controllers take the simulated time, so a trace runs as fast as the
+ * host allows.
+ *
+ * -k runs the built-in convergence checks instead of a trace and exits
+ * with 1 if one fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "bitrate_controller.h"
+#include "link_history.h"
+#include "link_predictor.h"
+
+#define SIM_STEP_MS             10
+#define SIM_CLOCK_BASE_MS       1000000     // the tracker runs on uptime, not on 0
+#define SIM_MAX_LINE            256
+#define SIM_MAX_CONTROLLERS     8
+#define DEFAULT_START_KBPS      4000
+#define DEFAULT_ENCODER_LAG_MS  500
+#define DEFAULT_IDR_COST_MS     200         // an idr frame is worth this much video
+#define DEFAULT_STALL_MS        500
+#define DEFAULT_QUEUE_LIMIT_MS  2000
+#define CHECK_UPDATE_MS         100
+#define CHECK_MAX_STEPS         4
+
+// a link input held for a while, then the bitrate the controller must end on
+struct sim_check {
+    const char* name;
+    const char* controller;
+    int adjust_mode;
+    int input[CHECK_MAX_STEPS];         // ul_bw or snr, 0 ends the list
+    uint32_t hold_ms[CHECK_MAX_STEPS];
+    int expect;
+};
+
+static const sim_check g_checks[] = {
+    // a recovery gap smaller than the smoothing divisor must still close
+    { "snr small recovery", "smoothed", BITRATE_ADJUST_BY_SNR,
+      { 20, 5, 12, 0 }, { 10000, 10000, 60000, 0 }, 12 },
+    { "snr small recovery", "aimd", BITRATE_ADJUST_BY_SNR,
+      { 20, 5, 12, 0 }, { 10000, 10000, 60000, 0 }, 12 },
+    // just past the hysteresis
+    { "snr small drop", "smoothed", BITRATE_ADJUST_BY_SNR,
+      { 12, 10, 0, 0 }, { 10000, 10000, 0, 0 }, 10 },
+};
+
+struct sim_options {
+    const char* controllers[SIM_MAX_CONTROLLERS];
+    int controller_count;
+    int predictor_cut;                  // 0 leaves the predictor in shadow mode
+    int start_kbps;
+    uint32_t encoder_lag_ms;
+    uint32_t idr_cost_ms;
+    uint32_t stall_ms;
+    uint32_t queue_limit_ms;
+    bool verbose;
+};
+
+struct sim_result {
+    uint64_t duration_ms;
+    uint64_t connected_ms;
+    uint64_t stall_ms;
+    double target_kbit;                 // integral of the target while connected
+    double encoded_kbit;
+    double delivered_kbit;
+    double dropped_kbit;
+    uint32_t bitrate_changes;
+    uint32_t idr_requests;
+    link_predictor_stats predictor;
+};
+
+struct sim_state {
+    double encoder_kbps;
+    int target_kbps;
+    bool paused;
+    double queue_kbit;
+};
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "usage: %s [options] trace.csv...\n"
+            "  -f file    system-control config to take the bitrate settings from\n"
+            "  -c names   comma separated controllers to compare (default from config)\n"
+            "  -p cut     let the link predictor act with this cut in percent\n"
+            "  -s kbps    encoder bitrate before the first update (default %d)\n"
+            "  -l ms      encoder lag (default %d)\n"
+            "  -i ms      video an idr frame is worth (default %d)\n"
+            "  -t ms      queueing delay counted as a stall (default %d)\n"
+            "  -q ms      queueing delay at which video is dropped (default %d)\n"
+            "  -k         run the built-in controller checks\n"
+            "  -v         print every bitrate decision\n",
+            name, DEFAULT_START_KBPS, DEFAULT_ENCODER_LAG_MS, DEFAULT_IDR_COST_MS,
+            DEFAULT_STALL_MS, DEFAULT_QUEUE_LIMIT_MS);
+}
+
+static uint64_t get_monotonic_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool parse_line(char* line, uint64_t* t_ms, d2d_info* info)
+{
+    unsigned long long t;
+    int srv_stat;
+
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    if (*line == '#' || *line == '\n' || *line == '\0') {
+        return false;
+    }
+    if (sscanf(line, "%llu,%d,%d,%d,%d,%d", &t, &srv_stat, &info->rsrp,
+               &info->ul_bandwidth, &info->ul_rate, &info->snr) != 6) {
+        return false;
+    }
+    *t_ms = t;
+    info->service_status = (srv_stat == 1) ? CONNECTED : DISCONNECTED;
+    info->timestamp = 0;
+    return true;
+}
+
+// advances the encoder and the uplink by one step on the current link
+static void step(const sim_options& opt, const d2d_info& link, sim_state* state,
+                 sim_result* result)
+{
+    bool connected = (link.service_status == CONNECTED);
+    double capacity = connected ? link.ul_bandwidth : 0;
+    double sent;
+    double limit;
+
+    if (state->paused) {
+        state->encoder_kbps = 0;
+    } else {
+        state->encoder_kbps += (state->target_kbps - state->encoder_kbps) *
+                               SIM_STEP_MS / (opt.encoder_lag_ms + SIM_STEP_MS);
+    }
+    state->queue_kbit += state->encoder_kbps * SIM_STEP_MS / 1000;
+    result->encoded_kbit += state->encoder_kbps * SIM_STEP_MS / 1000;
+
+    sent = capacity * SIM_STEP_MS / 1000;
+    if (sent > state->queue_kbit) {
+        sent = state->queue_kbit;
+    }
+    state->queue_kbit -= sent;
+    result->delivered_kbit += sent;
+
+    result->duration_ms += SIM_STEP_MS;
+    if (!connected) {
+        return;
+    }
+    result->connected_ms += SIM_STEP_MS;
+    result->target_kbit += (double)state->target_kbps * SIM_STEP_MS / 1000;
+    if (capacity <= 0 || state->queue_kbit * 1000 > capacity * opt.stall_ms) {
+        result->stall_ms += SIM_STEP_MS;
+    }
+    limit = capacity * opt.queue_limit_ms / 1000;
+    if (state->queue_kbit > limit) {
+        result->dropped_kbit += state->queue_kbit - limit;
+        state->queue_kbit = limit;
+    }
+}
+
+static void get_params(bitrate_params* params)
+{
+    Config* config = Config::get_instance();
+
+    params->min_bitrate = config->get_bitrate_min();
+    params->max_bitrate = config->get_bitrate_max();
+    params->hysteresis = config->get_bitrate_hysteresis();
+    params->min_interval_ms = config->get_bitrate_min_interval();
+    params->idr_min_interval_ms = config->get_bitrate_idr_min_interval();
+    params->ramp_holdoff_ms = config->get_bitrate_ramp_holdoff();
+}
+
+static bool run_trace(const char* filename, const char* controller,
+                      const sim_options& opt, sim_result* result)
+{
+    Config* config = Config::get_instance();
+    char line[SIM_MAX_LINE];
+    bitrate_params params;
+    bitrate_decision decision;
+    sim_state state;
+    d2d_info link;
+    d2d_info info;
+    uint64_t first_ms = 0;
+    uint64_t sim_ms = 0;
+    uint64_t t_ms;
+    bool started = false;
+    int lineno = 0;
+    FILE* file;
+
+    file = fopen(filename, "r");
+    if (file == nullptr) {
+        fprintf(stderr, "cannot open %s\n", filename);
+        return false;
+    }
+
+    get_params(&params);
+    BitrateController* bitrate_controller =
+        BitrateController::create(controller, BITRATE_ADJUST_BY_THROUGHPUT, params);
+    LinkHistory* history = new LinkHistory();
+    LinkPredictor* predictor = new LinkPredictor(history, config->get_link_predictor_horizon());
+    if (opt.predictor_cut > 0) {
+        bitrate_controller->set_predictor(predictor, opt.predictor_cut);
+    } else if (config->get_link_predictor_enabled()) {
+        bitrate_controller->set_predictor(predictor, config->get_link_predictor_cut());
+    }
+
+    bzero((void*)result, sizeof(*result));
+    bzero((void*)&link, sizeof(link));
+    link.service_status = DISCONNECTED;
+    state.encoder_kbps = opt.start_kbps;
+    state.target_kbps = opt.start_kbps;
+    state.paused = false;
+    state.queue_kbit = 0;
+
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        lineno++;
+        if (!parse_line(line, &t_ms, &info)) {
+            continue;
+        }
+        if (!started) {
+            first_ms = t_ms;
+            started = true;
+        }
+        if (t_ms < first_ms + sim_ms) {
+            fprintf(stderr, "%s:%d: time goes backwards, skipped\n", filename, lineno);
+            continue;
+        }
+        // the link holds its last reported state until the next update
+        while (first_ms + sim_ms + SIM_STEP_MS <= t_ms) {
+            step(opt, link, &state, result);
+            sim_ms += SIM_STEP_MS;
+        }
+        link = info;
+
+        history->add(info, SIM_CLOCK_BASE_MS + sim_ms);
+        predictor->update(info, SIM_CLOCK_BASE_MS + sim_ms);
+        decision = bitrate_controller->update(info, SIM_CLOCK_BASE_MS + sim_ms);
+        if (decision.set_bitrate) {
+            result->bitrate_changes++;
+            if (decision.bitrate == BITRATE_DUMMY_STATE) {
+                state.paused = true;
+            } else {
+                state.paused = false;
+                state.target_kbps = decision.bitrate;
+            }
+            if (opt.verbose) {
+                printf("%10llu  %s bitrate %d\n", (unsigned long long)sim_ms,
+                       bitrate_controller->get_name(), decision.bitrate);
+            }
+        }
+        if (decision.request_idr) {
+            result->idr_requests++;
+            state.queue_kbit += state.encoder_kbps * opt.idr_cost_ms / 1000;
+            result->encoded_kbit += state.encoder_kbps * opt.idr_cost_ms / 1000;
+            if (opt.verbose) {
+                printf("%10llu  %s idr\n", (unsigned long long)sim_ms,
+                       bitrate_controller->get_name());
+            }
+        }
+    }
+    // one more step so the last update is accounted for
+    if (started) {
+        step(opt, link, &state, result);
+    }
+    predictor->get_stats(&result->predictor);
+
+    fclose(file);
+    delete predictor;
+    delete history;
+    delete bitrate_controller;
+    return started;
+}
+
+static bool run_check(const sim_check& check)
+{
+    bitrate_params params;
+    bitrate_decision decision;
+    d2d_info info;
+    uint64_t now_ms = SIM_CLOCK_BASE_MS;
+    uint64_t end_ms;
+    int bitrate = BITRATE_DUMMY_STATE;
+    int i;
+
+    get_params(&params);
+    BitrateController* controller =
+        BitrateController::create(check.controller, check.adjust_mode, params);
+    bzero((void*)&info, sizeof(info));
+    info.service_status = CONNECTED;
+    for (i = 0; i < CHECK_MAX_STEPS && check.input[i] != 0; i++) {
+        info.ul_bandwidth = check.input[i];
+        info.snr = check.input[i];
+        for (end_ms = now_ms + check.hold_ms[i]; now_ms < end_ms; now_ms += CHECK_UPDATE_MS) {
+            decision = controller->update(info, now_ms);
+            if (decision.set_bitrate) {
+                bitrate = decision.bitrate;
+            }
+        }
+    }
+    delete controller;
+    printf("%-4s %-24s %-10s ended on %d, expected %d\n",
+           bitrate == check.expect ? "ok" : "FAIL", check.name, check.controller,
+           bitrate, check.expect);
+    return bitrate == check.expect;
+}
+
+static void print_result(const char* trace, const char* controller, const sim_result& r)
+{
+    double connected_s = (double)r.connected_ms / 1000;
+
+    printf("%-24s %-10s %9.1f %9.1f %8.0f %8.0f %8.1f %6.2f %5u %7u %9.0f %5u/%u/%u\n",
+           trace, controller,
+           (double)r.duration_ms / 1000, connected_s,
+           connected_s > 0 ? r.target_kbit / connected_s : 0,
+           connected_s > 0 ? r.delivered_kbit / connected_s : 0,
+           (double)r.stall_ms / 1000,
+           r.connected_ms > 0 ? 100.0 * r.stall_ms / r.connected_ms : 0,
+           r.idr_requests, r.bitrate_changes, r.dropped_kbit,
+           r.predictor.hits, r.predictor.false_alarms, r.predictor.missed);
+}
+
+static void add_result(sim_result* total, const sim_result& r)
+{
+    total->duration_ms += r.duration_ms;
+    total->connected_ms += r.connected_ms;
+    total->stall_ms += r.stall_ms;
+    total->target_kbit += r.target_kbit;
+    total->encoded_kbit += r.encoded_kbit;
+    total->delivered_kbit += r.delivered_kbit;
+    total->dropped_kbit += r.dropped_kbit;
+    total->bitrate_changes += r.bitrate_changes;
+    total->idr_requests += r.idr_requests;
+    total->predictor.predictions += r.predictor.predictions;
+    total->predictor.hits += r.predictor.hits;
+    total->predictor.false_alarms += r.predictor.false_alarms;
+    total->predictor.missed += r.predictor.missed;
+}
+
+int main(int argc, char *argv[])
+{
+    sim_options opt;
+    sim_result totals[SIM_MAX_CONTROLLERS];
+    sim_result result;
+    uint64_t simulated_ms = 0;
+    uint64_t start_us;
+    uint64_t elapsed_us;
+    char* names = nullptr;
+    char* saveptr = nullptr;
+    char* name;
+    bool check = false;
+    int failed = 0;
+    int c;
+    int i;
+    int t;
+
+    bzero((void*)&opt, sizeof(opt));
+    opt.start_kbps = DEFAULT_START_KBPS;
+    opt.encoder_lag_ms = DEFAULT_ENCODER_LAG_MS;
+    opt.idr_cost_ms = DEFAULT_IDR_COST_MS;
+    opt.stall_ms = DEFAULT_STALL_MS;
+    opt.queue_limit_ms = DEFAULT_QUEUE_LIMIT_MS;
+
+    while ((c = getopt(argc, argv, "f:c:p:s:l:i:t:q:kvh")) != -1) {
+        switch (c) {
+        case 'f':
+            Config::get_instance()->load_config(optarg);
+            break;
+        case 'c':
+            names = optarg;
+            break;
+        case 'p':
+            opt.predictor_cut = atoi(optarg);
+            break;
+        case 's':
+            opt.start_kbps = atoi(optarg);
+            break;
+        case 'l':
+            opt.encoder_lag_ms = atoi(optarg);
+            break;
+        case 'i':
+            opt.idr_cost_ms = atoi(optarg);
+            break;
+        case 't':
+            opt.stall_ms = atoi(optarg);
+            break;
+        case 'q':
+            opt.queue_limit_ms = atoi(optarg);
+            break;
+        case 'k':
+            check = true;
+            break;
+        case 'v':
+            opt.verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (check) {
+        for (i = 0; i < (int)(sizeof(g_checks) / sizeof(g_checks[0])); i++) {
+            if (!run_check(g_checks[i])) {
+                failed++;
+            }
+        }
+        return failed > 0 ? 1 : 0;
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (names != nullptr) {
+        for (name = strtok_r(names, ",", &saveptr);
+             name != nullptr && opt.controller_count < SIM_MAX_CONTROLLERS;
+             name = strtok_r(nullptr, ",", &saveptr)) {
+            opt.controllers[opt.controller_count++] = name;
+        }
+    }
+    if (opt.controller_count == 0) {
+        opt.controllers[opt.controller_count++] = Config::get_instance()->get_bitrate_controller();
+    }
+
+    printf("%-24s %-10s %9s %9s %8s %8s %8s %6s %5s %7s %9s %s\n",
+           "trace", "controller", "total_s", "conn_s", "target", "goodput",
+           "stall_s", "stall%", "idr", "changes", "drop_kbit", "hit/fa/miss");
+    bzero((void*)totals, sizeof(totals));
+    start_us = get_monotonic_us();
+    for (t = optind; t < argc; t++) {
+        for (i = 0; i < opt.controller_count; i++) {
+            if (!run_trace(argv[t], opt.controllers[i], opt, &result)) {
+                continue;
+            }
+            print_result(argv[t], opt.controllers[i], result);
+            add_result(&totals[i], result);
+            simulated_ms += result.duration_ms;
+        }
+    }
+    elapsed_us = get_monotonic_us() - start_us;
+    if (argc - optind > 1) {
+        for (i = 0; i < opt.controller_count; i++) {
+            print_result("total", opt.controllers[i], totals[i]);
+        }
+    }
+    printf("simulated %.1f s in %.3f s, %.0fx real time\n",
+           (double)simulated_ms / 1000, (double)elapsed_us / 1000000,
+           elapsed_us > 0 ? (double)simulated_ms * 1000 / elapsed_us : 0);
+    return 0;
+}
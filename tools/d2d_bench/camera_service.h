@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+/*
+ * Stands in for camera_service/camera_service.h in the d2d benchmark, so
+ * D2dTracker builds with CAMERA_EXIST and its encoder calls land in the
+ * benchmark instead of the camera. Only what the tracker uses is here.
+ */
+class CameraService {
+public:
+    static CameraService* get_instance();
+    int set_bitrate(int snr);
+    int request_idr();
+
+private:
+    CameraService() { }
+
+    static CameraService* _instance;
+};
@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures how fast D2dTracker takes in d2d updates. It runs the tracker
+ * in process with a stub CameraService, connects to the d2dinfo socket
+ * like the d2d service does and pushes TLV updates at rates doubling from
+ * step to step, until the tracker falls behind or the latency limit is
+ * exceeded.
+ *
+ * Every update carries a sequence number in its ul_bandwidth, which the
+ * legacy controller forwards to set_bitrate unchanged, so the stub can
+ * tell which update a call belongs to. RADIO_STATUS goes to a socket the
+ * benchmark binds as the board endpoint and is sent unpaced; it is matched
+ * to the update last seen by set_bitrate, which precedes it in the same
+ * wakeup. The tracker's cpu time is read on its own thread in set_bitrate.
+ *
+ * The d2dinfo socket is abstract, stop system-control before running it.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <cutils/sockets.h>
+#include <cutils/properties.h>
+#include "config.h"
+#include "d2d_tracker.h"
+#include "camera_service.h"
+
+#define BENCH_ROUTER_NAME       "d2dbench"
+#define BENCH_SEQ_BASE          100000      // ul_bandwidth of update n is base + n % ring
+#define BENCH_SEQ_RING          (1 << 20)
+#define BENCH_TLV_COUNT         5
+#define BENCH_DRAIN_MS          200         // settle time after each step
+#define BENCH_INGEST_PCT        95          // of the sent updates, below is saturated
+#define DEFAULT_CONFIG_FILE     "/data/local/tmp/d2d-bench.conf"
+#define DEFAULT_START_RATE      100         // updates per second
+#define DEFAULT_MAX_RATE        102400
+#define DEFAULT_STEP_MS         3000
+#define DEFAULT_LATENCY_LIMIT   100         // ms, p99 to set_bitrate
+
+struct __attribute__((packed)) bench_tlv {
+    uint8_t type;
+    uint8_t len;
+    int32_t value;
+};
+
+struct __attribute__((packed)) bench_frame {
+    uint32_t len;                           // network order, of what follows
+    d2d_tlv_header header;
+    bench_tlv tlv[BENCH_TLV_COUNT];
+};
+
+struct bench_samples {
+    pthread_mutex_t lock;
+    std::vector<uint32_t> bitrate_us;
+    std::vector<uint32_t> radio_us;
+};
+
+static std::atomic<uint64_t> g_send_us[BENCH_SEQ_RING];
+static std::atomic<uint32_t> g_applied_seq(0);     // last update seen by set_bitrate
+static std::atomic<uint32_t> g_applied_count(0);
+static std::atomic<uint32_t> g_radio_count(0);
+static std::atomic<uint32_t> g_idr_count(0);
+static std::atomic<int64_t> g_tracker_cpu_ns(0);
+static std::atomic<bool> g_exit(false);
+static bench_samples g_samples;
+
+CameraService* CameraService::_instance = nullptr;
+
+static uint64_t get_monotonic_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+CameraService* CameraService::get_instance()
+{
+    if (_instance == nullptr) {
+        _instance = new CameraService();
+    }
+    return _instance;
+}
+
+// runs on the tracker thread
+int CameraService::set_bitrate(int snr)
+{
+    uint64_t now = get_monotonic_us();
+    struct timespec ts;
+    uint32_t seq;
+
+    if (snr < BENCH_SEQ_BASE) {
+        // the dummy state on a disconnect
+        return 0;
+    }
+    seq = snr - BENCH_SEQ_BASE;
+    pthread_mutex_lock(&g_samples.lock);
+    g_samples.bitrate_us.push_back(now - g_send_us[seq].load(std::memory_order_relaxed));
+    pthread_mutex_unlock(&g_samples.lock);
+    g_applied_seq.store(seq, std::memory_order_release);
+    g_applied_count++;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    g_tracker_cpu_ns.store((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+    return 0;
+}
+
+int CameraService::request_idr()
+{
+    g_idr_count++;
+    return 0;
+}
+
+static void* radio_receiver(void* arg)
+{
+    int fd = *(int*)arg;
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    uint32_t seq;
+    uint64_t now;
+
+    while (!g_exit) {
+        if (recv(fd, buf, sizeof(buf), 0) <= 0) {
+            continue;
+        }
+        now = get_monotonic_us();
+        seq = g_applied_seq.load(std::memory_order_acquire);
+        pthread_mutex_lock(&g_samples.lock);
+        g_samples.radio_us.push_back(now - g_send_us[seq].load(std::memory_order_relaxed));
+        pthread_mutex_unlock(&g_samples.lock);
+        g_radio_count++;
+    }
+    return nullptr;
+}
+
+static int open_router_socket()
+{
+    struct sockaddr_un addr;
+    struct timeval tv = { 0, 100000 };
+    socklen_t len;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    bzero((void*)&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path + 1, BENCH_ROUTER_NAME);
+    len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(BENCH_ROUTER_NAME);
+    if (bind(fd, (struct sockaddr*)&addr, len) < 0) {
+        close(fd);
+        return -1;
+    }
+    // lets the receiver see g_exit
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+static bool write_config(const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+
+    if (file == nullptr) {
+        fprintf(stderr, "cannot write %s\n", filename);
+        return false;
+    }
+    fprintf(file,
+            "board_endpoint_name = %s\n"
+            "rc_socket_name = null\n"
+            "bitrate_controller = legacy\n"
+            "link_predictor_enabled = false\n"
+            "d2d_combine_rule = best\n"
+            "radio_status_interval = 0\n",
+            BENCH_ROUTER_NAME);
+    fclose(file);
+    return true;
+}
+
+static void set_tlv(bench_tlv* tlv, uint8_t type, int32_t value)
+{
+    tlv->type = type;
+    tlv->len = sizeof(tlv->value);
+    tlv->value = (int32_t)htonl(value);
+}
+
+static bool send_update(int fd, uint32_t n)
+{
+    bench_frame frame;
+    uint32_t seq = n % BENCH_SEQ_RING;
+    uint64_t now = get_monotonic_us();
+
+    frame.len = htonl(sizeof(frame) - sizeof(frame.len));
+    frame.header.magic = htons(D2D_TLV_MAGIC);
+    frame.header.version = D2D_TLV_VERSION;
+    frame.header.count = BENCH_TLV_COUNT;
+    frame.header.timestamp = htobe64(now);
+    set_tlv(&frame.tlv[0], D2D_TLV_SERVICE_STATUS, 1);
+    set_tlv(&frame.tlv[1], D2D_TLV_RSRP, -90);
+    set_tlv(&frame.tlv[2], D2D_TLV_UL_BANDWIDTH, BENCH_SEQ_BASE + seq);
+    set_tlv(&frame.tlv[3], D2D_TLV_UL_RATE, 1000);
+    set_tlv(&frame.tlv[4], D2D_TLV_SNR, 10);
+    g_send_us[seq].store(now, std::memory_order_relaxed);
+    return write(fd, &frame, sizeof(frame)) == (ssize_t)sizeof(frame);
+}
+
+static uint32_t percentile(std::vector<uint32_t>& v, int pct)
+{
+    size_t k;
+
+    if (v.empty()) {
+        return 0;
+    }
+    k = (v.size() - 1) * pct / 100;
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+static uint32_t maximum(const std::vector<uint32_t>& v)
+{
+    return v.empty() ? 0 : *std::max_element(v.begin(), v.end());
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -f file    config file written for the tracker (default %s)\n"
+            "  -r rate    first step in updates per second (default %d)\n"
+            "  -R rate    last step (default %d)\n"
+            "  -d ms      step duration (default %d)\n"
+            "  -l ms      p99 latency to set_bitrate that ends the run (default %d)\n",
+            name, DEFAULT_CONFIG_FILE, DEFAULT_START_RATE, DEFAULT_MAX_RATE,
+            DEFAULT_STEP_MS, DEFAULT_LATENCY_LIMIT);
+}
+
+int main(int argc, char *argv[])
+{
+    char prop_buf[PROPERTY_VALUE_MAX] = {0};
+    const char* config_file = DEFAULT_CONFIG_FILE;
+    uint32_t rate = DEFAULT_START_RATE;
+    uint32_t max_rate = DEFAULT_MAX_RATE;
+    uint32_t step_ms = DEFAULT_STEP_MS;
+    uint32_t latency_limit_ms = DEFAULT_LATENCY_LIMIT;
+    uint32_t sustained = 0;
+    uint32_t sent = 0;
+    uint32_t step_sent;
+    uint32_t first_seq;
+    uint32_t ingested;
+    uint32_t applied;
+    uint32_t applied_before;
+    int64_t cpu_before;
+    uint64_t start_us;
+    uint64_t elapsed_us;
+    uint64_t due;
+    D2dTracker* tracker;
+    pthread_t receiver;
+    int router_fd;
+    int d2d_fd;
+    int c;
+
+    while ((c = getopt(argc, argv, "f:r:R:d:l:h")) != -1) {
+        switch (c) {
+        case 'f':
+            config_file = optarg;
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'R':
+            max_rate = atoi(optarg);
+            break;
+        case 'd':
+            step_ms = atoi(optarg);
+            break;
+        case 'l':
+            latency_limit_ms = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (rate == 0 || step_ms == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    // the sequence numbers only survive the legacy controller in throughput mode
+    property_get("persist.camera.bitrate.adjust.mode", prop_buf, "0");
+    if (atoi(prop_buf) != 0) {
+        fprintf(stderr, "persist.camera.bitrate.adjust.mode must be 0\n");
+        return 1;
+    }
+    property_get("persist.camera.bitrate.controller", prop_buf, "legacy");
+    if (strcmp(prop_buf, "legacy")) {
+        fprintf(stderr, "persist.camera.bitrate.controller must be legacy or unset\n");
+        return 1;
+    }
+    if (!write_config(config_file)) {
+        return 1;
+    }
+    Config::get_instance()->load_config(config_file);
+
+    pthread_mutex_init(&g_samples.lock, nullptr);
+    router_fd = open_router_socket();
+    if (router_fd < 0) {
+        fprintf(stderr, "cannot bind %s\n", BENCH_ROUTER_NAME);
+        return 1;
+    }
+    pthread_create(&receiver, nullptr, radio_receiver, &router_fd);
+
+    tracker = new D2dTracker();
+    if (!tracker->start()) {
+        fprintf(stderr, "cannot start the tracker, is system-control running?\n");
+        return 1;
+    }
+    d2d_fd = socket_local_client(D2D_SOCKET_NAME, ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
+    if (d2d_fd < 0) {
+        fprintf(stderr, "cannot connect to %s\n", D2D_SOCKET_NAME);
+        return 1;
+    }
+
+    // connect once, so the idr and the first decision are out of the way
+    send_update(d2d_fd, sent++);
+    usleep(BENCH_DRAIN_MS * 1000);
+
+    printf("%8s %8s %8s %8s | %-22s | %-22s | %s\n", "rate", "sent/s", "ingest/s", "wakeup/s",
+           "bitrate p50/p99/max us", "radio p50/p99/max us", "cpu us/update");
+    for (; rate <= max_rate; rate *= 2) {
+        pthread_mutex_lock(&g_samples.lock);
+        g_samples.bitrate_us.clear();
+        g_samples.radio_us.clear();
+        pthread_mutex_unlock(&g_samples.lock);
+        applied_before = g_applied_count;
+        cpu_before = g_tracker_cpu_ns;
+        first_seq = g_applied_seq;
+        step_sent = 0;
+
+        start_us = get_monotonic_us();
+        while ((elapsed_us = get_monotonic_us() - start_us) < (uint64_t)step_ms * 1000) {
+            due = elapsed_us * rate / 1000000;
+            while (step_sent < due) {
+                if (!send_update(d2d_fd, sent++)) {
+                    fprintf(stderr, "d2d socket write failed\n");
+                    return 1;
+                }
+                step_sent++;
+            }
+            usleep(rate >= 1000 ? 1000 : 1000000 / rate);
+        }
+        usleep(BENCH_DRAIN_MS * 1000);
+
+        // updates coalesced into one wakeup still count as taken in
+        ingested = (g_applied_seq - first_seq) % BENCH_SEQ_RING;
+        applied = g_applied_count - applied_before;
+        pthread_mutex_lock(&g_samples.lock);
+        printf("%8u %8u %8u %8u | %6u %7u %7u | %6u %7u %7u | %.1f\n",
+               rate,
+               (uint32_t)((uint64_t)step_sent * 1000 / step_ms),
+               (uint32_t)((uint64_t)ingested * 1000 / step_ms),
+               (uint32_t)((uint64_t)applied * 1000 / step_ms),
+               percentile(g_samples.bitrate_us, 50), percentile(g_samples.bitrate_us, 99),
+               maximum(g_samples.bitrate_us),
+               percentile(g_samples.radio_us, 50), percentile(g_samples.radio_us, 99),
+               maximum(g_samples.radio_us),
+               ingested > 0 ? (double)(g_tracker_cpu_ns - cpu_before) / 1000 / ingested : 0);
+        fflush(stdout);
+        if ((uint64_t)ingested * 100 < (uint64_t)step_sent * BENCH_INGEST_PCT ||
+            percentile(g_samples.bitrate_us, 99) > latency_limit_ms * 1000) {
+            pthread_mutex_unlock(&g_samples.lock);
+            printf("saturated at %u updates/s\n", rate);
+            break;
+        }
+        pthread_mutex_unlock(&g_samples.lock);
+        sustained = rate;
+    }
+    printf("sustained %u updates/s, %u idr requests, %u radio status\n",
+           sustained, (uint32_t)g_idr_count, (uint32_t)g_radio_count);
+
+    g_exit = true;
+    close(d2d_fd);
+    pthread_join(receiver, nullptr);
+    tracker->stop();
+    return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs the built-in checks of the modules that build on the host, each on
+ * its own simulated clock, and exits with 1 if one fails. The checks share
+ * the process singletons, so every one of them runs at most once.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "camera_command_queue.h"
+#include "link_state.h"
+#include "telemetry_budget.h"
+
+#define CHECK_CLOCK_BASE_MS     1000000     // the modules run on uptime, not on 0
+#define CHECK_GCS_SYSID         255
+#define CHECK_GCS_COMPID        190
+
+struct module_check {
+    const char* name;
+    bool (*run)();
+};
+
+// a link state that stops changing must not throttle forever
+static bool check_budget_stale_link()
+{
+    TelemetryBudget* budget = TelemetryBudget::get_instance();
+    uint64_t now_ms = CHECK_CLOCK_BASE_MS;
+    d2d_info info;
+    int producer;
+    int i;
+
+    producer = budget->add_producer("check", TELEMETRY_PRIORITY_HIGH, 100, 1000, 10000);
+    if (producer < 0) {
+        return false;
+    }
+    bzero((void*)&info, sizeof(info));
+    info.service_status = CONNECTED;
+    info.ul_bandwidth = 1;
+    LinkState::get_instance()->publish(info, now_ms);
+    if (!budget->allow(producer, now_ms) || budget->allow(producer, now_ms + 1000)) {
+        printf("     the producer is not throttled on a 1 kbps link\n");
+        return false;
+    }
+    // no more updates, after the timeout the nominal interval is back
+    now_ms += 60000;
+    for (i = 0; i < 5; i++, now_ms += 1000) {
+        if (!budget->allow(producer, now_ms)) {
+            printf("     throttled %d s after the last link update\n",
+                   (int)((now_ms - CHECK_CLOCK_BASE_MS) / 1000));
+            return false;
+        }
+    }
+    return true;
+}
+
+static void get_command(uint16_t command, mavlink_message_t* msg)
+{
+    mavlink_command_long_t cmd;
+
+    bzero((void*)&cmd, sizeof(cmd));
+    cmd.target_component = MAV_COMP_ID_CAMERA;
+    cmd.command = command;
+    mavlink_msg_command_long_encode(CHECK_GCS_SYSID, CHECK_GCS_COMPID, msg, &cmd);
+}
+
+static bool push_command(CameraCommandQueue* queue, uint16_t command, int expect)
+{
+    camera_command replaced;
+    mavlink_message_t msg;
+    bool has_replaced;
+    uint8_t result;
+    int r;
+
+    get_command(command, &msg);
+    r = queue->push(msg, CHECK_CLOCK_BASE_MS, &result, &replaced, &has_replaced);
+    if (r != expect) {
+        printf("     push of command %d gave %d, expected %d\n", command, r, expect);
+    }
+    return r == expect;
+}
+
+// a start resent behind a stop asks for recording again, it is no duplicate
+static bool check_queue_start_stop_start()
+{
+    CameraCommandQueue queue;
+    camera_command command;
+
+    if (!push_command(&queue, MAV_CMD_VIDEO_START_CAPTURE, CAMERA_COMMAND_QUEUED) ||
+        queue.pop(&command, 0) != CAMERA_POP_COMMAND ||
+        !push_command(&queue, MAV_CMD_VIDEO_START_CAPTURE, CAMERA_COMMAND_DUPLICATE) ||
+        !push_command(&queue, MAV_CMD_VIDEO_STOP_CAPTURE, CAMERA_COMMAND_QUEUED) ||
+        !push_command(&queue, MAV_CMD_VIDEO_START_CAPTURE, CAMERA_COMMAND_QUEUED)) {
+        return false;
+    }
+    if (queue.pop(&command, 0) != CAMERA_POP_COMMAND ||
+        command.command != MAV_CMD_VIDEO_STOP_CAPTURE ||
+        queue.pop(&command, 0) != CAMERA_POP_COMMAND ||
+        command.command != MAV_CMD_VIDEO_START_CAPTURE) {
+        printf("     the queue does not end on a start\n");
+        return false;
+    }
+    return true;
+}
+
+static const module_check g_checks[] = {
+    { "budget stale link", check_budget_stale_link },
+    { "queue start stop start", check_queue_start_stop_start },
+};
+
+int main(int argc, char *argv[])
+{
+    int failed = 0;
+    bool ok;
+    int i;
+
+    for (i = 0; i < (int)(sizeof(g_checks) / sizeof(g_checks[0])); i++) {
+        ok = g_checks[i].run();
+        printf("%-4s %s\n", ok ? "ok" : "FAIL", g_checks[i].name);
+        if (!ok) {
+            failed++;
+        }
+    }
+    return failed > 0 ? 1 : 0;
+}